@@ -0,0 +1,263 @@
+#include "darknet.h"
+#include "blas.h"
+#include "convolutional_layer.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Times the vector primitives in blas.cpp against the scalar loops they
+ * replaced, on layer shapes from yolov3 at 416x416, and checks they agree.
+ *
+ *     make blasbench && ./blasbench [runs]
+ *
+ * DARKNET_BLAS and DARKNET_THREADS pick the kernel set and thread count.
+ */
+
+static void ref_fill(int N, float ALPHA, float *X, int INCX)
+{
+    int i;
+    for(i = 0; i < N; ++i) X[i*INCX] = ALPHA;
+}
+
+static void ref_copy(int N, float *X, int INCX, float *Y, int INCY)
+{
+    int i;
+    for(i = 0; i < N; ++i) Y[i*INCY] = X[i*INCX];
+}
+
+static void ref_axpy(int N, float ALPHA, float *X, int INCX, float *Y, int INCY)
+{
+    int i;
+    for(i = 0; i < N; ++i) Y[i*INCY] += ALPHA*X[i*INCX];
+}
+
+static void ref_scal(int N, float ALPHA, float *X, int INCX)
+{
+    int i;
+    for(i = 0; i < N; ++i) X[i*INCX] *= ALPHA;
+}
+
+static void ref_mean(float *x, int batch, int filters, int spatial, float *mean)
+{
+    float scale = 1./(batch * spatial);
+    int i,j,k;
+    for(i = 0; i < filters; ++i){
+        mean[i] = 0;
+        for(j = 0; j < batch; ++j){
+            for(k = 0; k < spatial; ++k){
+                int index = j*filters*spatial + i*spatial + k;
+                mean[i] += x[index];
+            }
+        }
+        mean[i] *= scale;
+    }
+}
+
+static void ref_variance(float *x, float *mean, int batch, int filters, int spatial, float *variance)
+{
+    float scale = 1./(batch * spatial - 1);
+    int i,j,k;
+    for(i = 0; i < filters; ++i){
+        variance[i] = 0;
+        for(j = 0; j < batch; ++j){
+            for(k = 0; k < spatial; ++k){
+                int index = j*filters*spatial + i*spatial + k;
+                variance[i] += pow((x[index] - mean[i]), 2);
+            }
+        }
+        variance[i] *= scale;
+    }
+}
+
+static void ref_normalize(float *x, float *mean, float *variance, int batch, int filters, int spatial)
+{
+    int b, f, i;
+    for(b = 0; b < batch; ++b){
+        for(f = 0; f < filters; ++f){
+            for(i = 0; i < spatial; ++i){
+                int index = b*filters*spatial + f*spatial + i;
+                x[index] = (x[index] - mean[f])/(sqrt(variance[f]) + .000001f);
+            }
+        }
+    }
+}
+
+static void ref_add_bias(float *output, float *biases, int batch, int n, int size)
+{
+    int i,j,b;
+    for(b = 0; b < batch; ++b){
+        for(i = 0; i < n; ++i){
+            for(j = 0; j < size; ++j){
+                output[(b*n + i)*size + j] += biases[i];
+            }
+        }
+    }
+}
+
+static void ref_scale_bias(float *output, float *scales, int batch, int n, int size)
+{
+    int i,j,b;
+    for(b = 0; b < batch; ++b){
+        for(i = 0; i < n; ++i){
+            for(j = 0; j < size; ++j){
+                output[(b*n + i)*size + j] *= scales[i];
+            }
+        }
+    }
+}
+
+static void ref_shortcut(int batch, int w1, int h1, int c1, float *add, int w2, int h2, int c2, float s1, float s2, float *out)
+{
+    int stride = w1/w2;
+    int sample = w2/w1;
+    if(stride < 1) stride = 1;
+    if(sample < 1) sample = 1;
+    int minw = (w1 < w2) ? w1 : w2;
+    int minh = (h1 < h2) ? h1 : h2;
+    int minc = (c1 < c2) ? c1 : c2;
+
+    int i,j,k,b;
+    for(b = 0; b < batch; ++b){
+        for(k = 0; k < minc; ++k){
+            for(j = 0; j < minh; ++j){
+                for(i = 0; i < minw; ++i){
+                    int out_index = i*sample + w2*(j*sample + h2*(k + c2*b));
+                    int add_index = i*stride + w1*(j*stride + h1*(k + c1*b));
+                    out[out_index] = s1*out[out_index] + s2*add[add_index];
+                }
+            }
+        }
+    }
+}
+
+static void ref_upsample(float *in, int w, int h, int c, int batch, int stride, int forward, float scale, float *out)
+{
+    int i, j, k, b;
+    for(b = 0; b < batch; ++b){
+        for(k = 0; k < c; ++k){
+            for(j = 0; j < h*stride; ++j){
+                for(i = 0; i < w*stride; ++i){
+                    int in_index = b*w*h*c + k*w*h + (j/stride)*w + i/stride;
+                    int out_index = b*w*h*c*stride*stride + k*w*h*stride*stride + j*w*stride + i;
+                    if(forward) out[out_index] = scale*in[in_index];
+                    else in[in_index] += scale*out[out_index];
+                }
+            }
+        }
+    }
+}
+
+typedef struct {
+    int w, h, c;
+} bench_shape;
+
+static const bench_shape shapes[] = {
+    {208, 208, 64}, {104, 104, 128}, {52, 52, 256}, {13, 13, 1024}
+};
+
+static int runs = 20;
+static float *x, *y, *x_init, *y_init, *a, *b;
+static size_t cap;
+
+static void reset()
+{
+    memcpy(x, x_init, cap*sizeof(float));
+    memcpy(y, y_init, cap*sizeof(float));
+}
+
+static float max_diff(const float *p, const float *q, size_t n)
+{
+    float diff = 0;
+    size_t i;
+    for(i = 0; i < n; ++i){
+        float d = fabsf(p[i] - q[i])/(fabsf(q[i]) > 1 ? fabsf(q[i]) : 1);
+        if(d > diff) diff = d;
+    }
+    return diff;
+}
+
+#define TIME(best, call) do { \
+    int r; \
+    best = 0; \
+    for(r = 0; r < runs; ++r){ \
+        reset(); \
+        double start = what_time_is_it_now(); \
+        call; \
+        double t = what_time_is_it_now() - start; \
+        if(r == 0 || t < best) best = t; \
+    } \
+} while(0)
+
+// Runs both versions from the same inputs, keeping the reference x and y in a and b
+#define BENCH(name, shape, n, ref, opt) do { \
+    double t_ref, t_opt; \
+    TIME(t_ref, ref); \
+    memcpy(a, x, cap*sizeof(float)); \
+    memcpy(b, y, cap*sizeof(float)); \
+    TIME(t_opt, opt); \
+    float d = max_diff(x, a, n); \
+    float e = max_diff(y, b, n); \
+    printf("%-10s %4dx%4dx%4d %9.3f ms %9.3f ms %6.2fx  diff %g\n", name, shape.w, shape.h, shape.c, \
+            t_ref*1000, t_opt*1000, t_ref/t_opt, d > e ? d : e); \
+} while(0)
+
+int main(int argc, char **argv)
+{
+    int i, s;
+    if(argc > 1) runs = atoi(argv[1]);
+    cap = 0;
+    for(s = 0; s < (int)(sizeof(shapes)/sizeof(shapes[0])); ++s){
+        size_t n = (size_t)shapes[s].w*shapes[s].h*shapes[s].c*4;
+        if(n > cap) cap = n;
+    }
+    x = (float *)calloc(cap, sizeof(float));
+    y = (float *)calloc(cap, sizeof(float));
+    a = (float *)calloc(cap, sizeof(float));
+    b = (float *)calloc(cap, sizeof(float));
+    x_init = (float *)calloc(cap, sizeof(float));
+    y_init = (float *)calloc(cap, sizeof(float));
+    for(i = 0; i < (int)cap; ++i){
+        x_init[i] = rand_uniform(-2, 2);
+        y_init[i] = rand_uniform(-2, 2);
+    }
+    float *mean = (float *)calloc(1024, sizeof(float));
+    float *var = (float *)calloc(1024, sizeof(float));
+    float *mean_ref = (float *)calloc(1024, sizeof(float));
+    float *var_ref = (float *)calloc(1024, sizeof(float));
+    for(i = 0; i < 1024; ++i){
+        mean[i] = rand_uniform(-1, 1);
+        var[i] = rand_uniform(.5, 2);
+    }
+
+    printf("%-10s %19s %12s %12s\n", "op", "shape", "old", "new");
+    for(s = 0; s < (int)(sizeof(shapes)/sizeof(shapes[0])); ++s){
+        bench_shape sh = shapes[s];
+        int n = sh.w*sh.h*sh.c;
+        int sp = sh.w*sh.h;
+        BENCH("fill", sh, n, ref_fill(n, .5, x, 1), fill_cpu(n, .5, x, 1));
+        BENCH("copy", sh, n, ref_copy(n, x, 1, y, 1), copy_cpu(n, x, 1, y, 1));
+        BENCH("axpy", sh, n, ref_axpy(n, .5, x, 1, y, 1), axpy_cpu(n, .5, x, 1, y, 1));
+        BENCH("scal", sh, n, ref_scal(n, .5, x, 1), scal_cpu(n, .5, x, 1));
+        BENCH("normalize", sh, n, ref_normalize(x, mean, var, 1, sh.c, sp), normalize_cpu(x, mean, var, 1, sh.c, sp));
+        BENCH("add_bias", sh, n, ref_add_bias(x, mean, 1, sh.c, sp), add_bias(x, mean, 1, sh.c, sp));
+        BENCH("scale_bias", sh, n, ref_scale_bias(x, var, 1, sh.c, sp), scale_bias(x, var, 1, sh.c, sp));
+        BENCH("shortcut", sh, n, ref_shortcut(1, sh.w, sh.h, sh.c, x, sh.w, sh.h, sh.c, 1, 1, y),
+                shortcut_cpu(1, sh.w, sh.h, sh.c, x, sh.w, sh.h, sh.c, 1, 1, y));
+        if(sh.w <= 104){
+            BENCH("upsample", sh, 4*n, ref_upsample(x, sh.w, sh.h, sh.c, 1, 2, 1, 1, y),
+                    upsample_cpu(x, sh.w, sh.h, sh.c, 1, 2, 1, 1, y));
+        }
+
+        double t_ref, t_opt;
+        TIME(t_ref, (ref_mean(x, 1, sh.c, sp, mean_ref), ref_variance(x, mean_ref, 1, sh.c, sp, var_ref)));
+        TIME(t_opt, (mean_cpu(x, 1, sh.c, sp, mean), variance_cpu(x, mean, 1, sh.c, sp, var)));
+        float d = max_diff(mean, mean_ref, sh.c);
+        float e = max_diff(var, var_ref, sh.c);
+        printf("%-10s %4dx%4dx%4d %9.3f ms %9.3f ms %6.2fx  diff %g\n", "mean+var", sh.w, sh.h, sh.c,
+                t_ref*1000, t_opt*1000, t_ref/t_opt, d > e ? d : e);
+    }
+    return 0;
+}
@@ -244,7 +244,9 @@ void validate_detector_flip(char *datacfg, char *cfgfile, char *weightfile, char
     if (mapf) map = read_map(mapf);
 
     network *net = load_network(cfgfile, weightfile, 0);
+    if(net->threads) set_thread_pool_threads(net->threads);
     set_batch_network(net, 2);
+    optimize_network(net);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net->learning_rate, net->momentum, net->decay);
     srand(time(0));
 
@@ -361,7 +363,7 @@ void validate_detector_flip(char *datacfg, char *cfgfile, char *weightfile, char
 }
 
 
-void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *outfile)
+void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *outfile, char *int8file)
 {
     int j;
     list *options = read_data_cfg(datacfg);
@@ -374,7 +376,10 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
     if (mapf) map = read_map(mapf);
 
     network *net = load_network(cfgfile, weightfile, 0);
+    if(net->threads) set_thread_pool_threads(net->threads);
     set_batch_network(net, 1);
+    if(int8file) load_int8_scales(net, int8file);
+    optimize_network(net);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net->learning_rate, net->momentum, net->decay);
     srand(time(0));
 
@@ -489,7 +494,9 @@ void validate_detector(char *datacfg, char *cfgfile, char *weightfile, char *out
 void validate_detector_recall(char *cfgfile, char *weightfile)
 {
     network *net = load_network(cfgfile, weightfile, 0);
+    if(net->threads) set_thread_pool_threads(net->threads);
     set_batch_network(net, 1);
+    optimize_network(net);
     fprintf(stderr, "Learning Rate: %g, Momentum: %g, Decay: %g\n", net->learning_rate, net->momentum, net->decay);
     srand(time(0));
 
@@ -559,7 +566,7 @@ void validate_detector_recall(char *cfgfile, char *weightfile)
 }
 
 
-void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, char *outfile, int fullscreen)
+void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filename, float thresh, float hier_thresh, char *outfile, int fullscreen, char *int8file)
 {
     list *options = read_data_cfg(datacfg);
     char *name_list = option_find_str(options, "names", "data/names.list");
@@ -567,7 +574,10 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
 
     image **alphabet = load_alphabet();
     network *net = load_network(cfgfile, weightfile, 0);
+    if(net->threads) set_thread_pool_threads(net->threads);
     set_batch_network(net, 1);
+    if(int8file) load_int8_scales(net, int8file);
+    optimize_network(net);
     srand(2222222);
     double time;
     char buff[256];
@@ -620,6 +630,136 @@ void test_detector(char *datacfg, char *cfgfile, char *weightfile, char *filenam
     }
 }
 
+void calibrate_detector(char *datacfg, char *cfgfile, char *weightfile, char *outfile, int n)
+{
+    list *options = read_data_cfg(datacfg);
+    char *valid_images = option_find_str(options, "valid", "data/train.list");
+    char *calib_images = option_find_str(options, "calib", valid_images);
+
+    network *net = load_network(cfgfile, weightfile, 0);
+    set_batch_network(net, 1);
+
+    list *plist = get_paths(calib_images);
+    char **paths = (char **)list_to_array(plist);
+    if(n > plist->size) n = plist->size;
+
+    float *ranges = calloc(net->n, sizeof(float));
+    int i;
+    for(i = 0; i < n; ++i){
+        image im = load_image_color(paths[i], 0, 0);
+        image sized = letterbox_image(im, net->w, net->h);
+        calibrate_int8(net, sized.data, ranges);
+        free_image(im);
+        free_image(sized);
+        if((i+1)%10 == 0) fprintf(stderr, "%d/%d\n", i+1, n);
+    }
+    if(!outfile) outfile = "int8.scales";
+    save_int8_scales(net, ranges, outfile);
+    fprintf(stderr, "Calibrated on %d images, scales written to %s\n", n, outfile);
+    free(ranges);
+    free(paths);
+    free_list(plist);
+}
+
+static int same_detections(detection *a, int na, detection *b, int nb)
+{
+    int i, j;
+    if(na != nb) return 0;
+    for(i = 0; i < na; ++i){
+        if(memcmp(&a[i].bbox, &b[i].bbox, sizeof(box)) || a[i].objectness != b[i].objectness) return 0;
+        for(j = 0; j < a[i].classes; ++j){
+            if(a[i].prob[j] != b[i].prob[j]) return 0;
+        }
+    }
+    return 1;
+}
+
+static int same_pipeline_detections(network *r, image im, detection *dets, int nboxes, float thresh, float hier_thresh, float nms, char *path)
+{
+    layer l = r->layers[r->n-1];
+    int num = 0;
+    detection *pdets = get_network_boxes(r, im.w, im.h, thresh, hier_thresh, 0, 1, &num);
+    if (nms) do_nms_sort(pdets, num, l.classes, nms);
+    int same = same_detections(dets, nboxes, pdets, num);
+    if(!same) fprintf(stderr, "%s: pipelined detections differ\n", path);
+    free_detections(pdets, num);
+    return same;
+}
+
+// Runs the valid images through network_predict and then through a pipeline
+// of the same network, and checks both give the same detections
+void pipeline_detector(char *datacfg, char *cfgfile, char *weightfile, int stages, int n, float thresh, float hier_thresh)
+{
+    list *options = read_data_cfg(datacfg);
+    char *valid_images = option_find_str(options, "valid", "data/train.list");
+
+    if(stages < 1) stages = 1;
+    network *net = load_network_inference(cfgfile, weightfile);
+    if(net->threads) set_thread_pool_threads(net->threads);
+    set_batch_network(net, 1);
+    optimize_network(net);
+    layer l = net->layers[net->n-1];
+    float nms = .45;
+
+    list *plist = get_paths(valid_images);
+    char **paths = (char **)list_to_array(plist);
+    if(n > plist->size) n = plist->size;
+
+    detection **dets = calloc(n, sizeof(detection *));
+    int *nboxes = calloc(n, sizeof(int));
+    double sequential = 0;
+    int i;
+    for(i = 0; i < n; ++i){
+        image im = load_image_color(paths[i], 0, 0);
+        image sized = letterbox_image(im, net->w, net->h);
+        double time = what_time_is_it_now();
+        network_predict(net, sized.data);
+        sequential += what_time_is_it_now() - time;
+        dets[i] = get_network_boxes(net, im.w, im.h, thresh, hier_thresh, 0, 1, nboxes + i);
+        if (nms) do_nms_sort(dets[i], nboxes[i], l.classes, nms);
+        free_image(im);
+        free_image(sized);
+    }
+
+    network_pipeline *p = make_network_pipeline(net, stages);
+    image *ims = calloc(stages, sizeof(image));
+    double pipelined = 0;
+    int done = 0;
+    int matched = 0;
+    for(i = 0; i < n; ++i){
+        image im = load_image_color(paths[i], 0, 0);
+        image sized = letterbox_image(im, net->w, net->h);
+        ims[i%stages] = im;
+        double time = what_time_is_it_now();
+        network *r = pipeline_predict(p, sized.data);
+        pipelined += what_time_is_it_now() - time;
+        free_image(sized);
+        if(!r) continue;
+        matched += same_pipeline_detections(r, ims[done%stages], dets[done], nboxes[done], thresh, hier_thresh, nms, paths[done]);
+        free_image(ims[done%stages]);
+        ++done;
+    }
+    while(done < n){
+        double time = what_time_is_it_now();
+        network *r = pipeline_flush(p);
+        pipelined += what_time_is_it_now() - time;
+        matched += same_pipeline_detections(r, ims[done%stages], dets[done], nboxes[done], thresh, hier_thresh, nms, paths[done]);
+        free_image(ims[done%stages]);
+        ++done;
+    }
+    fprintf(stderr, "%d/%d images match, network_predict %f s, %d stage pipeline %f s per image\n",
+            matched, n, sequential/n, stages, pipelined/n);
+
+    free_network_pipeline(p);
+    for(i = 0; i < n; ++i) free_detections(dets[i], nboxes[i]);
+    free_network(net);
+    free(dets);
+    free(nboxes);
+    free(ims);
+    free(paths);
+    free_list(plist);
+}
+
 /*
 void censor_detector(char *datacfg, char *cfgfile, char *weightfile, int cam_index, const char *filename, int class_id, float thresh, int skip)
 {
@@ -795,7 +935,7 @@ void run_detector(int argc, char **argv)
     int frame_skip = find_int_arg(argc, argv, "-s", 0);
     int avg = find_int_arg(argc, argv, "-avg", 3);
     if(argc < 4){
-        fprintf(stderr, "usage: %s %s [train/test/valid] [cfg] [weights (optional)]\n", argv[0], argv[1]);
+        fprintf(stderr, "usage: %s %s [train/test/valid/calibrate/pipeline] [cfg] [weights (optional)]\n", argv[0], argv[1]);
         return;
     }
     char *gpu_list = find_char_arg(argc, argv, "-gpus", 0);
@@ -827,17 +967,22 @@ void run_detector(int argc, char **argv)
     int width = find_int_arg(argc, argv, "-w", 0);
     int height = find_int_arg(argc, argv, "-h", 0);
     int fps = find_int_arg(argc, argv, "-fps", 0);
+    char *int8file = find_char_arg(argc, argv, "-int8", 0);
+    int calib_images = find_int_arg(argc, argv, "-images", 100);
+    int stages = find_int_arg(argc, argv, "-stages", 2);
     //int class_id = find_int_arg(argc, argv, "-class", 0);
 
     char *datacfg = argv[3];
     char *cfg = argv[4];
     char *weights = (argc > 5) ? argv[5] : 0;
     char *filename = (argc > 6) ? argv[6]: 0;
-    if(0==strcmp(argv[2], "test")) test_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, outfile, fullscreen);
+    if(0==strcmp(argv[2], "test")) test_detector(datacfg, cfg, weights, filename, thresh, hier_thresh, outfile, fullscreen, int8file);
     else if(0==strcmp(argv[2], "train")) train_detector(datacfg, cfg, weights, gpus, ngpus, clear);
-    else if(0==strcmp(argv[2], "valid")) validate_detector(datacfg, cfg, weights, outfile);
+    else if(0==strcmp(argv[2], "valid")) validate_detector(datacfg, cfg, weights, outfile, int8file);
+    else if(0==strcmp(argv[2], "calibrate")) calibrate_detector(datacfg, cfg, weights, outfile, calib_images);
     else if(0==strcmp(argv[2], "valid2")) validate_detector_flip(datacfg, cfg, weights, outfile);
     else if(0==strcmp(argv[2], "recall")) validate_detector_recall(cfg, weights);
+    else if(0==strcmp(argv[2], "pipeline")) pipeline_detector(datacfg, cfg, weights, stages, calib_images, thresh, hier_thresh);
     else if(0==strcmp(argv[2], "demo")) {
         list *options = read_data_cfg(datacfg);
         int classes = option_find_int(options, "classes", 20);
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdint.h>
 
 #ifdef GPU
     #define BLOCK 512
@@ -53,6 +54,14 @@ typedef enum{
     MULT, ADD, SUB, DIV
 } BINARY_ACTIVATION;
 
+typedef enum{
+    CONV_GEMM, CONV_IM2COL, CONV_WINOGRAD, CONV_DEPTHWISE, CONV_AUTO, CONV_TUNE
+} CONV_ALGO;
+
+typedef enum{
+    WEIGHTS_FP32, WEIGHTS_FP16, WEIGHTS_BF16
+} WEIGHT_FORMAT;
+
 typedef enum {
     CONVOLUTIONAL,
     DECONVOLUTIONAL,
@@ -104,6 +113,7 @@ typedef struct{
 
 struct network;
 typedef struct network network;
+typedef struct network_pipeline network_pipeline;
 
 struct layer;
 typedef struct layer layer;
@@ -146,6 +156,11 @@ struct layer{
     int index;
     int binary;
     int xnor;
+    CONV_ALGO algo;
+    WEIGHT_FORMAT weight_format;
+    int fused;
+    int output_alias;
+    int weights_mapped;
     int steps;
     int hidden;
     int truth;
@@ -224,6 +239,17 @@ struct layer{
     float * concat_delta;
 
     float * binary_weights;
+    float * winograd_weights;
+    float * packed_weights;
+    float * fused_scales;
+    float * fused_biases;
+
+    float input_scale;
+    int8_t * int8_weights;
+    float * int8_scales;
+    uint16_t * half_weights;
+    uint64_t * xnor_weights;
+    float * xnor_scales;
 
     float * biases;
     float * bias_updates;
@@ -284,6 +310,8 @@ struct layer{
 
     float * binary_input;
 
+    struct layer *fused_shortcut;
+    struct layer *fused_maxpool;
     struct layer *input_layer;
     struct layer *self_layer;
     struct layer *output_layer;
@@ -477,8 +505,26 @@ typedef struct network{
     float *truth;
     float *delta;
     float *workspace;
+    size_t workspace_size;
+    float *arena;
+    size_t arena_size;
+    void *weights_map;
+    size_t weights_map_size;
     int train;
+    int inference;
     int index;
+    CONV_ALGO conv_algo;
+    int prepack;
+    int fuse_maxpool;
+    int plan_memory;
+    int parallel_branches;
+    int threads;
+    int *schedule;
+    int *levels;
+    int num_levels;
+    int branch_width;
+    WEIGHT_FORMAT weight_format;
+    char *tune_cache;
     float *cost;
     float clip;
 
@@ -581,6 +627,11 @@ typedef struct{
 
 
 network *load_network(char *cfg, char *weights, int clear);
+network *load_network_inference(char *cfg, char *weights);
+void optimize_network(network *net);
+void calibrate_int8(network *net, float *input, float *ranges);
+void save_int8_scales(network *net, float *ranges, char *filename);
+void load_int8_scales(network *net, char *filename);
 load_args get_base_args(network *net);
 
 void free_data(data d);
@@ -676,6 +727,7 @@ int option_find_int(list *l, char *key, int def);
 int option_find_int_quiet(list *l, char *key, int def);
 
 network *parse_network_cfg(char *filename);
+network *parse_network_cfg_inference(char *filename);
 void save_weights(network *net, char *filename);
 void load_weights(network *net, char *filename);
 void save_weights_upto(network *net, char *filename, int cutoff);
@@ -686,6 +738,11 @@ void get_region_detections(layer l, int w, int h, int netw, int neth, float thre
 int get_yolo_detections(layer l, int w, int h, int netw, int neth, float thresh, int *map, int relative, detection *dets);
 void free_network(network *net);
 void set_batch_network(network *net, int b);
+void set_thread_pool_threads(int threads);
+network_pipeline *make_network_pipeline(network *net, int stages);
+network *pipeline_predict(network_pipeline *p, float *input);
+network *pipeline_flush(network_pipeline *p);
+void free_network_pipeline(network_pipeline *p);
 void set_temp_network(network *net, float t);
 image load_image(char *filename, int w, int h, int c);
 image load_image_color(char *filename, int w, int h);
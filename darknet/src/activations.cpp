@@ -1,10 +1,13 @@
 #include "activations.h"
+#include "thread_pool.h"
 
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define ACTIVATE_GRAIN 16384
+
 char *get_activation_string(ACTIVATION a)
 {
     switch(a){
@@ -97,12 +100,313 @@ float activate(float x, ACTIVATION a)
     return 0;
 }
 
-void activate_array(float *x, const int n, const ACTIVATION a)
+/*
+ * activate_array and gradient_array pick one specialised loop per call
+ * instead of switching on the activation for every element. With AVX2 the
+ * common activations run eight lanes at a time, exp based ones through a
+ * polynomial exp accurate to a couple of ulp.
+ */
+
+typedef void (*activate_fn)(float *x, int n);
+typedef void (*gradient_fn)(const float *x, int n, float *delta);
+
+template <float (*F)(float)>
+static void activate_loop(float *x, int n)
+{
+    int i;
+    for(i = 0; i < n; ++i) x[i] = F(x[i]);
+}
+
+template <float (*F)(float)>
+static void gradient_loop(const float *x, int n, float *delta)
+{
+    int i;
+    for(i = 0; i < n; ++i) delta[i] *= F(x[i]);
+}
+
+static void activate_none(float *x, int n) {}
+static void gradient_none(const float *x, int n, float *delta) {}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// exp(x) = 2^k * exp(r), |r| <= ln2/2, exp(r) from a degree 5 polynomial
+__attribute__((target("avx2,fma")))
+static inline __m256 exp_avx2(__m256 x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.3365f)), _mm256_set1_ps(88.0f));
+    __m256 k = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(k, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(k, _mm256_set1_ps(-2.12194440e-4f), r);
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1)));
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 logistic_avx2(__m256 x)
+{
+    __m256 one = _mm256_set1_ps(1);
+    return _mm256_div_ps(one, _mm256_add_ps(one, exp_avx2(_mm256_sub_ps(_mm256_setzero_ps(), x))));
+}
+
+// Written around exp(2x) + 1 so large inputs saturate at +-1 instead of inf/inf
+__attribute__((target("avx2,fma")))
+static inline __m256 tanh_avx2(__m256 x)
+{
+    __m256 one = _mm256_set1_ps(1);
+    __m256 e = exp_avx2(_mm256_add_ps(x, x));
+    return _mm256_sub_ps(one, _mm256_div_ps(_mm256_set1_ps(2), _mm256_add_ps(e, one)));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 leaky_avx2(__m256 x)
+{
+    __m256 neg = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LE_OQ);
+    return _mm256_blendv_ps(x, _mm256_mul_ps(x, _mm256_set1_ps(.1f)), neg);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 relu_avx2(__m256 x)
+{
+    return _mm256_max_ps(x, _mm256_setzero_ps());
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 relie_avx2(__m256 x)
+{
+    __m256 neg = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LE_OQ);
+    return _mm256_blendv_ps(x, _mm256_mul_ps(x, _mm256_set1_ps(.01f)), neg);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 ramp_avx2(__m256 x)
+{
+    return _mm256_fmadd_ps(x, _mm256_set1_ps(.1f), _mm256_max_ps(x, _mm256_setzero_ps()));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 loggy_avx2(__m256 x)
+{
+    return _mm256_fmsub_ps(logistic_avx2(x), _mm256_set1_ps(2), _mm256_set1_ps(1));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 elu_avx2(__m256 x)
+{
+    __m256 neg = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ);
+    return _mm256_blendv_ps(x, _mm256_sub_ps(exp_avx2(x), _mm256_set1_ps(1)), neg);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 selu_avx2(__m256 x)
+{
+    __m256 neg = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ);
+    __m256 lo = _mm256_mul_ps(_mm256_set1_ps(1.0507f*1.6732f), _mm256_sub_ps(exp_avx2(x), _mm256_set1_ps(1)));
+    return _mm256_blendv_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.0507f)), lo, neg);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 hardtan_avx2(__m256 x)
+{
+    return _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-1)), _mm256_set1_ps(1));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 plse_avx2(__m256 x)
+{
+    __m256 mid = _mm256_fmadd_ps(x, _mm256_set1_ps(.125f), _mm256_set1_ps(.5f));
+    __m256 lo = _mm256_mul_ps(_mm256_set1_ps(.01f), _mm256_add_ps(x, _mm256_set1_ps(4)));
+    __m256 hi = _mm256_fmadd_ps(_mm256_set1_ps(.01f), _mm256_sub_ps(x, _mm256_set1_ps(4)), _mm256_set1_ps(1));
+    mid = _mm256_blendv_ps(mid, lo, _mm256_cmp_ps(x, _mm256_set1_ps(-4), _CMP_LT_OQ));
+    return _mm256_blendv_ps(mid, hi, _mm256_cmp_ps(x, _mm256_set1_ps(4), _CMP_GT_OQ));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 lhtan_avx2(__m256 x)
+{
+    __m256 lo = _mm256_mul_ps(x, _mm256_set1_ps(.001f));
+    __m256 hi = _mm256_fmadd_ps(_mm256_set1_ps(.001f), _mm256_sub_ps(x, _mm256_set1_ps(1)), _mm256_set1_ps(1));
+    __m256 y = _mm256_blendv_ps(x, lo, _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+    return _mm256_blendv_ps(y, hi, _mm256_cmp_ps(x, _mm256_set1_ps(1), _CMP_GT_OQ));
+}
+
+template <__m256 (*V)(__m256), float (*F)(float)>
+__attribute__((target("avx2,fma")))
+static void activate_loop_avx2(float *x, int n)
 {
     int i;
-    for(i = 0; i < n; ++i){
-        x[i] = activate(x[i], a);
+    for(i = 0; i + 8 <= n; i += 8) _mm256_storeu_ps(x + i, V(_mm256_loadu_ps(x + i)));
+    for(; i < n; ++i) x[i] = F(x[i]);
+}
+
+// Gradients take the activated output, so logistic, tanh and the linear
+// pieces are all arithmetic and selects
+__attribute__((target("avx2,fma")))
+static void gradient_leaky_avx2(const float *x, int n, float *delta)
+{
+    int i;
+    for(i = 0; i + 8 <= n; i += 8){
+        __m256 g = _mm256_blendv_ps(_mm256_set1_ps(.1f), _mm256_set1_ps(1),
+                _mm256_cmp_ps(_mm256_loadu_ps(x + i), _mm256_setzero_ps(), _CMP_GT_OQ));
+        _mm256_storeu_ps(delta + i, _mm256_mul_ps(_mm256_loadu_ps(delta + i), g));
+    }
+    for(; i < n; ++i) delta[i] *= leaky_gradient(x[i]);
+}
+
+__attribute__((target("avx2,fma")))
+static void gradient_relu_avx2(const float *x, int n, float *delta)
+{
+    int i;
+    for(i = 0; i + 8 <= n; i += 8){
+        __m256 pos = _mm256_cmp_ps(_mm256_loadu_ps(x + i), _mm256_setzero_ps(), _CMP_GT_OQ);
+        _mm256_storeu_ps(delta + i, _mm256_and_ps(_mm256_loadu_ps(delta + i), pos));
+    }
+    for(; i < n; ++i) delta[i] *= relu_gradient(x[i]);
+}
+
+__attribute__((target("avx2,fma")))
+static void gradient_logistic_avx2(const float *x, int n, float *delta)
+{
+    int i;
+    for(i = 0; i + 8 <= n; i += 8){
+        __m256 y = _mm256_loadu_ps(x + i);
+        __m256 g = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(1), y), y);
+        _mm256_storeu_ps(delta + i, _mm256_mul_ps(_mm256_loadu_ps(delta + i), g));
+    }
+    for(; i < n; ++i) delta[i] *= logistic_gradient(x[i]);
+}
+
+__attribute__((target("avx2,fma")))
+static void gradient_tanh_avx2(const float *x, int n, float *delta)
+{
+    int i;
+    for(i = 0; i + 8 <= n; i += 8){
+        __m256 y = _mm256_loadu_ps(x + i);
+        __m256 g = _mm256_fnmadd_ps(y, y, _mm256_set1_ps(1));
+        _mm256_storeu_ps(delta + i, _mm256_mul_ps(_mm256_loadu_ps(delta + i), g));
+    }
+    for(; i < n; ++i) delta[i] *= tanh_gradient(x[i]);
+}
+#endif
+
+static int use_avx2()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static int avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return avx2;
+#else
+    return 0;
+#endif
+}
+
+static activate_fn get_activate_fn(ACTIVATION a)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(use_avx2()){
+        switch(a){
+            case LOGISTIC: return activate_loop_avx2<logistic_avx2, logistic_activate>;
+            case LOGGY:    return activate_loop_avx2<loggy_avx2, loggy_activate>;
+            case RELU:     return activate_loop_avx2<relu_avx2, relu_activate>;
+            case ELU:      return activate_loop_avx2<elu_avx2, elu_activate>;
+            case SELU:     return activate_loop_avx2<selu_avx2, selu_activate>;
+            case RELIE:    return activate_loop_avx2<relie_avx2, relie_activate>;
+            case RAMP:     return activate_loop_avx2<ramp_avx2, ramp_activate>;
+            case LEAKY:    return activate_loop_avx2<leaky_avx2, leaky_activate>;
+            case TANH:     return activate_loop_avx2<tanh_avx2, tanh_activate>;
+            case PLSE:     return activate_loop_avx2<plse_avx2, plse_activate>;
+            case HARDTAN:  return activate_loop_avx2<hardtan_avx2, hardtan_activate>;
+            case LHTAN:    return activate_loop_avx2<lhtan_avx2, lhtan_activate>;
+            default: break;
+        }
+    }
+#endif
+    switch(a){
+        case LINEAR:   return activate_none;
+        case LOGISTIC: return activate_loop<logistic_activate>;
+        case LOGGY:    return activate_loop<loggy_activate>;
+        case RELU:     return activate_loop<relu_activate>;
+        case ELU:      return activate_loop<elu_activate>;
+        case SELU:     return activate_loop<selu_activate>;
+        case RELIE:    return activate_loop<relie_activate>;
+        case RAMP:     return activate_loop<ramp_activate>;
+        case LEAKY:    return activate_loop<leaky_activate>;
+        case TANH:     return activate_loop<tanh_activate>;
+        case PLSE:     return activate_loop<plse_activate>;
+        case STAIR:    return activate_loop<stair_activate>;
+        case HARDTAN:  return activate_loop<hardtan_activate>;
+        case LHTAN:    return activate_loop<lhtan_activate>;
+    }
+    return activate_none;
+}
+
+static gradient_fn get_gradient_fn(ACTIVATION a)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if(use_avx2()){
+        switch(a){
+            case LOGISTIC: return gradient_logistic_avx2;
+            case RELU:     return gradient_relu_avx2;
+            case LEAKY:    return gradient_leaky_avx2;
+            case TANH:     return gradient_tanh_avx2;
+            default: break;
+        }
     }
+#endif
+    switch(a){
+        case LINEAR:   return gradient_none;
+        case LOGISTIC: return gradient_loop<logistic_gradient>;
+        case LOGGY:    return gradient_loop<loggy_gradient>;
+        case RELU:     return gradient_loop<relu_gradient>;
+        case ELU:      return gradient_loop<elu_gradient>;
+        case SELU:     return gradient_loop<selu_gradient>;
+        case RELIE:    return gradient_loop<relie_gradient>;
+        case RAMP:     return gradient_loop<ramp_gradient>;
+        case LEAKY:    return gradient_loop<leaky_gradient>;
+        case TANH:     return gradient_loop<tanh_gradient>;
+        case PLSE:     return gradient_loop<plse_gradient>;
+        case STAIR:    return gradient_loop<stair_gradient>;
+        case HARDTAN:  return gradient_loop<hardtan_gradient>;
+        case LHTAN:    return gradient_loop<lhtan_gradient>;
+    }
+    return gradient_none;
+}
+
+void activate_span(float *x, int n, ACTIVATION a)
+{
+    get_activate_fn(a)(x, n);
+}
+
+typedef struct {
+    float *x;
+    const float *y;
+    activate_fn activate;
+    gradient_fn gradient;
+} activate_job;
+
+static void activate_range(void *ptr, int begin, int end)
+{
+    activate_job *j = (activate_job *)ptr;
+    j->activate(j->x + begin, end - begin);
+}
+
+static void gradient_range(void *ptr, int begin, int end)
+{
+    activate_job *j = (activate_job *)ptr;
+    j->gradient(j->y + begin, end - begin, j->x + begin);
+}
+
+void activate_array(float *x, const int n, const ACTIVATION a)
+{
+    activate_job j = {x, 0, get_activate_fn(a), 0};
+    if(a == LINEAR) return;
+    parallel_for(n, ACTIVATE_GRAIN, activate_range, &j);
 }
 
 float gradient(float x, ACTIVATION a)
@@ -142,9 +446,8 @@ float gradient(float x, ACTIVATION a)
 
 void gradient_array(const float *x, const int n, const ACTIVATION a, float *delta)
 {
-    int i;
-    for(i = 0; i < n; ++i){
-        delta[i] *= gradient(x[i], a);
-    }
-} 
+    activate_job j = {delta, x, 0, get_gradient_fn(a)};
+    if(a == LINEAR) return;
+    parallel_for(n, ACTIVATE_GRAIN, gradient_range, &j);
+}
 
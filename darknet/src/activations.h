@@ -11,6 +11,9 @@ float activate(float x, ACTIVATION a);
 float gradient(float x, ACTIVATION a);
 void gradient_array(const float *x, const int n, const ACTIVATION a, float *delta);
 void activate_array(float *x, const int n, const ACTIVATION a);
+// activate_array on the calling thread alone, for epilogues of work that is
+// already split across the pool
+void activate_span(float *x, int n, ACTIVATION a);
 #ifdef GPU
 void activate_array_gpu(float *x, int n, ACTIVATION a);
 void gradient_array_gpu(float *x, int n, ACTIVATION a, float *delta);
@@ -37,7 +40,7 @@ static inline float selu_activate(float x){return (x >= 0)*1.0507*x + (x < 0)*1.
 static inline float relie_activate(float x){return (x>0) ? x : .01*x;}
 static inline float ramp_activate(float x){return x*(x>0)+.1*x;}
 static inline float leaky_activate(float x){return (x>0) ? x : .1*x;}
-static inline float tanh_activate(float x){return (exp(2*x)-1)/(exp(2*x)+1);}
+static inline float tanh_activate(float x){return 1 - 2/(exp(2*x)+1);}
 static inline float plse_activate(float x)
 {
     if(x < -4) return .01 * (x + 4);
@@ -1,4 +1,5 @@
 #include "blas.h"
+#include "thread_pool.h"
 
 #include <math.h>
 #include <assert.h>
@@ -6,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
 void reorg_cpu(float *x, int w, int h, int c, int batch, int stride, int forward, float *out)
 {
     int b,i,j,k;
@@ -65,6 +67,424 @@ void weighted_delta_cpu(float *a, float *b, float *s, float *da, float *db, floa
     }
 }
 
+/*
+ * Kernels behind the contiguous paths of the vector primitives below. One
+ * table is picked per process from the CPU, or by name from DARKNET_BLAS,
+ * and calls above BLAS_PARALLEL_MIN elements are split across the thread
+ * pool. Strided calls keep the plain loops.
+ */
+
+#define BLAS_PARALLEL_MIN 65536
+#define BLAS_GRAIN 16384
+
+typedef struct {
+    const char *name;
+    void (*fill)(int n, float a, float *x);
+    void (*scal)(int n, float a, float *x);
+    void (*shift)(int n, float a, float *x);
+    void (*norm)(int n, float m, float s, float *x);
+    void (*axpy)(int n, float a, const float *x, float *y);
+    void (*axpby)(int n, float a, const float *x, float b, float *y);
+    float (*sum)(int n, const float *x);
+    float (*sumsq)(int n, float m, const float *x);
+    void (*dup2)(int n, float a, const float *x, float *y);
+} blas_kernel;
+
+static void fill_generic(int n, float a, float *x)
+{
+    int i;
+    for(i = 0; i < n; ++i) x[i] = a;
+}
+
+static void scal_generic(int n, float a, float *x)
+{
+    int i;
+    for(i = 0; i < n; ++i) x[i] *= a;
+}
+
+static void shift_generic(int n, float a, float *x)
+{
+    int i;
+    for(i = 0; i < n; ++i) x[i] += a;
+}
+
+static void norm_generic(int n, float m, float s, float *x)
+{
+    int i;
+    for(i = 0; i < n; ++i) x[i] = (x[i] - m)*s;
+}
+
+static void axpy_generic(int n, float a, const float *x, float *y)
+{
+    int i;
+    for(i = 0; i < n; ++i) y[i] += a*x[i];
+}
+
+// y = b*y + a*x
+static void axpby_generic(int n, float a, const float *x, float b, float *y)
+{
+    int i;
+    for(i = 0; i < n; ++i) y[i] = b*y[i] + a*x[i];
+}
+
+static float sum_generic(int n, const float *x)
+{
+    int i;
+    float sum = 0;
+    for(i = 0; i < n; ++i) sum += x[i];
+    return sum;
+}
+
+static float sumsq_generic(int n, float m, const float *x)
+{
+    int i;
+    float sum = 0;
+    for(i = 0; i < n; ++i) sum += (x[i] - m)*(x[i] - m);
+    return sum;
+}
+
+// y[2i] = y[2i+1] = a*x[i]
+static void dup2_generic(int n, float a, const float *x, float *y)
+{
+    int i;
+    for(i = 0; i < n; ++i){
+        float v = a*x[i];
+        y[2*i] = v;
+        y[2*i + 1] = v;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2,fma")))
+static void fill_avx2(int n, float a, float *x)
+{
+    __m256 av = _mm256_set1_ps(a);
+    int i = 0;
+    for(; i + 8 <= n; i += 8) _mm256_storeu_ps(x + i, av);
+    for(; i < n; ++i) x[i] = a;
+}
+
+__attribute__((target("avx2,fma")))
+static void scal_avx2(int n, float a, float *x)
+{
+    __m256 av = _mm256_set1_ps(a);
+    int i = 0;
+    for(; i + 8 <= n; i += 8) _mm256_storeu_ps(x + i, _mm256_mul_ps(av, _mm256_loadu_ps(x + i)));
+    for(; i < n; ++i) x[i] *= a;
+}
+
+__attribute__((target("avx2,fma")))
+static void shift_avx2(int n, float a, float *x)
+{
+    __m256 av = _mm256_set1_ps(a);
+    int i = 0;
+    for(; i + 8 <= n; i += 8) _mm256_storeu_ps(x + i, _mm256_add_ps(av, _mm256_loadu_ps(x + i)));
+    for(; i < n; ++i) x[i] += a;
+}
+
+__attribute__((target("avx2,fma")))
+static void norm_avx2(int n, float m, float s, float *x)
+{
+    __m256 mv = _mm256_set1_ps(m);
+    __m256 sv = _mm256_set1_ps(s);
+    int i = 0;
+    for(; i + 8 <= n; i += 8) _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + i), mv), sv));
+    for(; i < n; ++i) x[i] = (x[i] - m)*s;
+}
+
+__attribute__((target("avx2,fma")))
+static void axpy_avx2(int n, float a, const float *x, float *y)
+{
+    __m256 av = _mm256_set1_ps(a);
+    int i = 0;
+    for(; i + 8 <= n; i += 8){
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(av, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for(; i < n; ++i) y[i] += a*x[i];
+}
+
+__attribute__((target("avx2,fma")))
+static void axpby_avx2(int n, float a, const float *x, float b, float *y)
+{
+    __m256 av = _mm256_set1_ps(a);
+    __m256 bv = _mm256_set1_ps(b);
+    int i = 0;
+    for(; i + 8 <= n; i += 8){
+        __m256 by = _mm256_mul_ps(bv, _mm256_loadu_ps(y + i));
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(av, _mm256_loadu_ps(x + i), by));
+    }
+    for(; i < n; ++i) y[i] = b*y[i] + a*x[i];
+}
+
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+// Four accumulators hide the add latency
+__attribute__((target("avx2,fma")))
+static float sum_avx2(int n, const float *x)
+{
+    __m256 s0 = _mm256_setzero_ps(), s1 = s0, s2 = s0, s3 = s0;
+    int i = 0;
+    for(; i + 32 <= n; i += 32){
+        s0 = _mm256_add_ps(s0, _mm256_loadu_ps(x + i));
+        s1 = _mm256_add_ps(s1, _mm256_loadu_ps(x + i + 8));
+        s2 = _mm256_add_ps(s2, _mm256_loadu_ps(x + i + 16));
+        s3 = _mm256_add_ps(s3, _mm256_loadu_ps(x + i + 24));
+    }
+    for(; i + 8 <= n; i += 8) s0 = _mm256_add_ps(s0, _mm256_loadu_ps(x + i));
+    float sum = hsum_avx2(_mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+    for(; i < n; ++i) sum += x[i];
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static float sumsq_avx2(int n, float m, const float *x)
+{
+    __m256 mv = _mm256_set1_ps(m);
+    __m256 s0 = _mm256_setzero_ps(), s1 = s0, s2 = s0, s3 = s0;
+    int i = 0;
+    for(; i + 32 <= n; i += 32){
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x + i), mv);
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(x + i + 8), mv);
+        __m256 d2 = _mm256_sub_ps(_mm256_loadu_ps(x + i + 16), mv);
+        __m256 d3 = _mm256_sub_ps(_mm256_loadu_ps(x + i + 24), mv);
+        s0 = _mm256_fmadd_ps(d0, d0, s0);
+        s1 = _mm256_fmadd_ps(d1, d1, s1);
+        s2 = _mm256_fmadd_ps(d2, d2, s2);
+        s3 = _mm256_fmadd_ps(d3, d3, s3);
+    }
+    for(; i + 8 <= n; i += 8){
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(x + i), mv);
+        s0 = _mm256_fmadd_ps(d, d, s0);
+    }
+    float sum = hsum_avx2(_mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+    for(; i < n; ++i) sum += (x[i] - m)*(x[i] - m);
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static void dup2_avx2(int n, float a, const float *x, float *y)
+{
+    __m256 av = _mm256_set1_ps(a);
+    int i = 0;
+    for(; i + 8 <= n; i += 8){
+        __m256 v = _mm256_mul_ps(av, _mm256_loadu_ps(x + i));
+        // x0 x0 x1 x1 x4 x4 x5 x5 and x2 x2 x3 x3 x6 x6 x7 x7, then swap the middle halves
+        __m256 lo = _mm256_unpacklo_ps(v, v);
+        __m256 hi = _mm256_unpackhi_ps(v, v);
+        _mm256_storeu_ps(y + 2*i, _mm256_permute2f128_ps(lo, hi, 0x20));
+        _mm256_storeu_ps(y + 2*i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+    }
+    dup2_generic(n - i, a, x + i, y + 2*i);
+}
+#endif
+
+static const blas_kernel blas_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx2", fill_avx2, scal_avx2, shift_avx2, norm_avx2, axpy_avx2, axpby_avx2, sum_avx2, sumsq_avx2, dup2_avx2},
+#endif
+    {"generic", fill_generic, scal_generic, shift_generic, norm_generic, axpy_generic, axpby_generic, sum_generic, sumsq_generic, dup2_generic},
+};
+
+static int blas_kernel_supported(const blas_kernel *k)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(strcmp(k->name, "avx2") == 0) return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+    return 1;
+}
+
+static const blas_kernel *select_blas_kernel()
+{
+    int n = sizeof(blas_kernels)/sizeof(blas_kernels[0]);
+    int i;
+    char *name = getenv("DARKNET_BLAS");
+    if(name){
+        for(i = 0; i < n; ++i){
+            if(strcmp(blas_kernels[i].name, name) != 0) continue;
+            if(blas_kernel_supported(blas_kernels + i)) return blas_kernels + i;
+            fprintf(stderr, "This CPU can't run BLAS kernel %s, going with generic\n", name);
+            return blas_kernels + n - 1;
+        }
+        fprintf(stderr, "Unknown BLAS kernel %s, picking automatically\n", name);
+    }
+    for(i = 0; i < n - 1; ++i){
+        if(blas_kernel_supported(blas_kernels + i)) return blas_kernels + i;
+    }
+    return blas_kernels + n - 1;
+}
+
+static const blas_kernel *get_blas_kernel()
+{
+    static const blas_kernel *kernel = select_blas_kernel();
+    return kernel;
+}
+
+typedef enum {
+    BLAS_FILL, BLAS_SCAL, BLAS_AXPY, BLAS_AXPBY, BLAS_COPY
+} blas_op;
+
+typedef struct {
+    blas_op op;
+    float a, b;
+    const float *x;
+    float *y;
+} blas_job;
+
+static void blas_range(void *ptr, int begin, int end)
+{
+    blas_job *j = (blas_job *)ptr;
+    const blas_kernel *k = get_blas_kernel();
+    int n = end - begin;
+    switch(j->op){
+        case BLAS_FILL:
+            k->fill(n, j->a, j->y + begin);
+            break;
+        case BLAS_SCAL:
+            k->scal(n, j->a, j->y + begin);
+            break;
+        case BLAS_AXPY:
+            k->axpy(n, j->a, j->x + begin, j->y + begin);
+            break;
+        case BLAS_AXPBY:
+            k->axpby(n, j->a, j->x + begin, j->b, j->y + begin);
+            break;
+        case BLAS_COPY:
+            memcpy(j->y + begin, j->x + begin, n*sizeof(float));
+            break;
+    }
+}
+
+static void blas_run(blas_op op, int n, float a, float b, const float *x, float *y)
+{
+    blas_job j = {op, a, b, x, y};
+    if(n < BLAS_PARALLEL_MIN) blas_range(&j, 0, n);
+    else parallel_for(n, BLAS_GRAIN, blas_range, &j);
+}
+
+// Per channel reductions and updates over batch x filters x spatial arrays.
+// Reductions split over filters, updates over batch x filters rows.
+typedef enum {
+    CHANNEL_MEAN, CHANNEL_VARIANCE, CHANNEL_NORMALIZE, CHANNEL_ADD, CHANNEL_SCALE
+} channel_op;
+
+typedef struct {
+    channel_op op;
+    float *x;
+    float *p, *q;
+    int batch, filters, spatial;
+} channel_job;
+
+static void channel_range(void *ptr, int begin, int end)
+{
+    channel_job *j = (channel_job *)ptr;
+    const blas_kernel *k = get_blas_kernel();
+    size_t plane = (size_t)j->filters*j->spatial;
+    int i, b;
+    for(i = begin; i < end; ++i){
+        if(j->op == CHANNEL_MEAN || j->op == CHANNEL_VARIANCE){
+            float sum = 0;
+            for(b = 0; b < j->batch; ++b){
+                float *x = j->x + b*plane + (size_t)i*j->spatial;
+                sum += j->op == CHANNEL_MEAN ? k->sum(j->spatial, x) : k->sumsq(j->spatial, j->p[i], x);
+            }
+            if(j->op == CHANNEL_MEAN) j->p[i] = sum/(j->batch*j->spatial);
+            else j->q[i] = sum/(j->batch*j->spatial - 1);
+        } else {
+            int f = i%j->filters;
+            float *x = j->x + (size_t)i*j->spatial;
+            if(j->op == CHANNEL_NORMALIZE) k->norm(j->spatial, j->p[f], 1.f/(sqrtf(j->q[f]) + .000001f), x);
+            else if(j->op == CHANNEL_ADD) k->shift(j->spatial, j->p[f], x);
+            else k->scal(j->spatial, j->p[f], x);
+        }
+    }
+}
+
+static void channel_run(channel_op op, float *x, float *p, float *q, int batch, int filters, int spatial)
+{
+    channel_job j = {op, x, p, q, batch, filters, spatial};
+    int n = (op == CHANNEL_MEAN || op == CHANNEL_VARIANCE) ? filters : batch*filters;
+    int grain = BLAS_GRAIN/(spatial*(n == filters ? batch : 1)) + 1;
+    if((size_t)batch*filters*spatial < BLAS_PARALLEL_MIN) channel_range(&j, 0, n);
+    else parallel_for(n, grain, channel_range, &j);
+}
+
+typedef struct {
+    float *in;
+    int w, h, stride, forward;
+    float scale;
+    float *out;
+} upsample_job;
+
+// Forward, each output row is built once, stride 2 by the duplicating
+// kernel, and copied to the stride - 1 rows below it
+static void upsample_planes(void *ptr, int begin, int end)
+{
+    upsample_job *u = (upsample_job *)ptr;
+    const blas_kernel *k = get_blas_kernel();
+    int w = u->w, h = u->h, stride = u->stride;
+    int ow = w*stride;
+    int p, i, j, r, s;
+    for(p = begin; p < end; ++p){
+        float *in = u->in + (size_t)p*w*h;
+        float *out = u->out + (size_t)p*w*h*stride*stride;
+        for(j = 0; j < h; ++j){
+            float *src = in + j*w;
+            float *dst = out + j*stride*ow;
+            if(u->forward){
+                if(stride == 2){
+                    k->dup2(w, u->scale, src, dst);
+                } else {
+                    for(i = 0; i < w; ++i){
+                        float v = u->scale*src[i];
+                        for(s = 0; s < stride; ++s) dst[i*stride + s] = v;
+                    }
+                }
+                for(s = 1; s < stride; ++s) memcpy(dst + s*ow, dst, ow*sizeof(float));
+            } else {
+                for(r = 0; r < stride; ++r){
+                    float *d = dst + r*ow;
+                    for(i = 0; i < w; ++i){
+                        for(s = 0; s < stride; ++s) src[i] += u->scale*d[i*stride + s];
+                    }
+                }
+            }
+        }
+    }
+}
+
+typedef struct {
+    int w1, h1, c1, w2, h2, c2;
+    int stride, sample, minw, minh, minc;
+    float s1, s2;
+    float *add, *out;
+} shortcut_job;
+
+static void shortcut_planes(void *ptr, int begin, int end)
+{
+    shortcut_job *s = (shortcut_job *)ptr;
+    int p, i, j;
+    for(p = begin; p < end; ++p){
+        int b = p/s->minc, k = p%s->minc;
+        for(j = 0; j < s->minh; ++j){
+            float *out = s->out + s->w2*(j*s->sample + (size_t)s->h2*(k + s->c2*b));
+            float *add = s->add + s->w1*(j*s->stride + (size_t)s->h1*(k + s->c1*b));
+            for(i = 0; i < s->minw; ++i){
+                out[i*s->sample] = s->s1*out[i*s->sample] + s->s2*add[i*s->stride];
+            }
+        }
+    }
+}
+
 void shortcut_cpu(int batch, int w1, int h1, int c1, float *add, int w2, int h2, int c2, float s1, float s2, float *out)
 {
     int stride = w1/w2;
@@ -77,50 +497,23 @@ void shortcut_cpu(int batch, int w1, int h1, int c1, float *add, int w2, int h2,
     int minh = (h1 < h2) ? h1 : h2;
     int minc = (c1 < c2) ? c1 : c2;
 
-    int i,j,k,b;
-    for(b = 0; b < batch; ++b){
-        for(k = 0; k < minc; ++k){
-            for(j = 0; j < minh; ++j){
-                for(i = 0; i < minw; ++i){
-                    int out_index = i*sample + w2*(j*sample + h2*(k + c2*b));
-                    int add_index = i*stride + w1*(j*stride + h1*(k + c1*b));
-                    out[out_index] = s1*out[out_index] + s2*add[add_index];
-                }
-            }
-        }
+    if(w1 == w2 && h1 == h2 && c1 == c2){
+        blas_run(BLAS_AXPBY, batch*w1*h1*c1, s2, s1, add, out);
+        return;
     }
+    shortcut_job s = {w1, h1, c1, w2, h2, c2, stride, sample, minw, minh, minc, s1, s2, add, out};
+    if((size_t)batch*minc*minh*minw < BLAS_PARALLEL_MIN) shortcut_planes(&s, 0, batch*minc);
+    else parallel_for(batch*minc, 1, shortcut_planes, &s);
 }
 
 void mean_cpu(float *x, int batch, int filters, int spatial, float *mean)
 {
-    float scale = 1./(batch * spatial);
-    int i,j,k;
-    for(i = 0; i < filters; ++i){
-        mean[i] = 0;
-        for(j = 0; j < batch; ++j){
-            for(k = 0; k < spatial; ++k){
-                int index = j*filters*spatial + i*spatial + k;
-                mean[i] += x[index];
-            }
-        }
-        mean[i] *= scale;
-    }
+    channel_run(CHANNEL_MEAN, x, mean, 0, batch, filters, spatial);
 }
 
 void variance_cpu(float *x, float *mean, int batch, int filters, int spatial, float *variance)
 {
-    float scale = 1./(batch * spatial - 1);
-    int i,j,k;
-    for(i = 0; i < filters; ++i){
-        variance[i] = 0;
-        for(j = 0; j < batch; ++j){
-            for(k = 0; k < spatial; ++k){
-                int index = j*filters*spatial + i*spatial + k;
-                variance[i] += pow((x[index] - mean[i]), 2);
-            }
-        }
-        variance[i] *= scale;
-    }
+    channel_run(CHANNEL_VARIANCE, x, mean, variance, batch, filters, spatial);
 }
 
 void l2normalize_cpu(float *x, float *dx, int batch, int filters, int spatial)
@@ -146,15 +539,17 @@ void l2normalize_cpu(float *x, float *dx, int batch, int filters, int spatial)
 
 void normalize_cpu(float *x, float *mean, float *variance, int batch, int filters, int spatial)
 {
-    int b, f, i;
-    for(b = 0; b < batch; ++b){
-        for(f = 0; f < filters; ++f){
-            for(i = 0; i < spatial; ++i){
-                int index = b*filters*spatial + f*spatial + i;
-                x[index] = (x[index] - mean[f])/(sqrt(variance[f]) + .000001f);
-            }
-        }
-    }
+    channel_run(CHANNEL_NORMALIZE, x, mean, variance, batch, filters, spatial);
+}
+
+void add_bias(float *output, float *biases, int batch, int n, int size)
+{
+    channel_run(CHANNEL_ADD, output, biases, 0, batch, n, size);
+}
+
+void scale_bias(float *output, float *scales, int batch, int n, int size)
+{
+    channel_run(CHANNEL_SCALE, output, scales, 0, batch, n, size);
 }
 
 void const_cpu(int N, float ALPHA, float *X, int INCX)
@@ -178,18 +573,30 @@ void pow_cpu(int N, float ALPHA, float *X, int INCX, float *Y, int INCY)
 void axpy_cpu(int N, float ALPHA, float *X, int INCX, float *Y, int INCY)
 {
     int i;
+    if(INCX == 1 && INCY == 1){
+        blas_run(BLAS_AXPY, N, ALPHA, 0, X, Y);
+        return;
+    }
     for(i = 0; i < N; ++i) Y[i*INCY] += ALPHA*X[i*INCX];
 }
 
 void scal_cpu(int N, float ALPHA, float *X, int INCX)
 {
     int i;
+    if(INCX == 1){
+        blas_run(BLAS_SCAL, N, ALPHA, 0, 0, X);
+        return;
+    }
     for(i = 0; i < N; ++i) X[i*INCX] *= ALPHA;
 }
 
 void fill_cpu(int N, float ALPHA, float *X, int INCX)
 {
     int i;
+    if(INCX == 1){
+        blas_run(BLAS_FILL, N, ALPHA, 0, 0, X);
+        return;
+    }
     for(i = 0; i < N; ++i) X[i*INCX] = ALPHA;
 }
 
@@ -226,6 +633,10 @@ void inter_cpu(int NX, float *X, int NY, float *Y, int B, float *OUT)
 void copy_cpu(int N, float *X, int INCX, float *Y, int INCY)
 {
     int i;
+    if(INCX == 1 && INCY == 1){
+        blas_run(BLAS_COPY, N, 0, 0, X, Y);
+        return;
+    }
     for(i = 0; i < N; ++i) Y[i*INCY] = X[i*INCX];
 }
 
@@ -333,19 +744,146 @@ void softmax_cpu(float *input, int n, int batch, int batch_offset, int groups, i
 
 void upsample_cpu(float *in, int w, int h, int c, int batch, int stride, int forward, float scale, float *out)
 {
-    int i, j, k, b;
-    for(b = 0; b < batch; ++b){
-        for(k = 0; k < c; ++k){
-            for(j = 0; j < h*stride; ++j){
-                for(i = 0; i < w*stride; ++i){
-                    int in_index = b*w*h*c + k*w*h + (j/stride)*w + i/stride;
-                    int out_index = b*w*h*c*stride*stride + k*w*h*stride*stride + j*w*stride + i;
-                    if(forward) out[out_index] = scale*in[in_index];
-                    else in[in_index] += scale*out[out_index];
-                }
-            }
+    upsample_job u = {in, w, h, stride, forward, scale, out};
+    if((size_t)batch*c*w*h*stride*stride < BLAS_PARALLEL_MIN) upsample_planes(&u, 0, batch*c);
+    else parallel_for(batch*c, 1, upsample_planes, &u);
+}
+
+static uint16_t float_to_fp16(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int exp = ((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+    if(((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if(exp >= 31) return sign | 0x7c00;
+    if(exp <= 0){
+        if(exp < -10) return sign;
+        mant |= 0x800000;
+        int shift = 14 - exp;
+        uint32_t h = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t half = 1u << (shift - 1);
+        if(rem > half || (rem == half && (h & 1))) ++h;
+        return sign | h;
+    }
+    uint32_t h = ((uint32_t)exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if(rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h;
+    return sign | h;
+}
+
+static float fp16_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t x;
+    if(exp == 0x1f){
+        x = sign | 0x7f800000 | (mant << 13);
+    } else if(exp){
+        x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    } else if(mant){
+        exp = 127 - 15 + 1;
+        while(!(mant & 0x400)){
+            mant <<= 1;
+            --exp;
         }
+        x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    } else {
+        x = sign;
     }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static uint16_t float_to_bf16(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if((x & 0x7fffffff) > 0x7f800000) return (x >> 16) | 0x40;
+    x += 0x7fff + ((x >> 16) & 1);
+    return x >> 16;
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx,f16c")))
+static int float_to_fp16_f16c(int n, const float *x, uint16_t *y)
+{
+    int i;
+    for(i = 0; i + 8 <= n; i += 8){
+        _mm_storeu_si128((__m128i *)(y + i), _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    return i;
+}
 
+__attribute__((target("avx,f16c")))
+static int fp16_to_float_f16c(int n, const uint16_t *x, float *y)
+{
+    int i;
+    for(i = 0; i + 8 <= n; i += 8){
+        _mm256_storeu_ps(y + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(x + i))));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int bf16_to_float_avx2(int n, const uint16_t *x, float *y)
+{
+    int i;
+    for(i = 0; i + 8 <= n; i += 8){
+        __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(x + i)));
+        _mm256_storeu_si256((__m256i *)(y + i), _mm256_slli_epi32(v, 16));
+    }
+    return i;
+}
+
+static int has_f16c()
+{
+    static int f16c = -1;
+    if(f16c < 0) f16c = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+    return f16c;
+}
+
+static int has_avx2()
+{
+    static int avx2 = -1;
+    if(avx2 < 0) avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+#endif
+
+void float_to_half_cpu(int n, WEIGHT_FORMAT format, const float *x, uint16_t *y)
+{
+    int i = 0;
+    if(format == WEIGHTS_BF16){
+        for(; i < n; ++i) y[i] = float_to_bf16(x[i]);
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if(has_f16c()) i = float_to_fp16_f16c(n, x, y);
+#endif
+    for(; i < n; ++i) y[i] = float_to_fp16(x[i]);
+}
+
+void half_to_float_cpu(int n, WEIGHT_FORMAT format, const uint16_t *x, float *y)
+{
+    int i = 0;
+    if(format == WEIGHTS_BF16){
+#if defined(__x86_64__) || defined(__i386__)
+        if(has_avx2()) i = bf16_to_float_avx2(n, x, y);
+#endif
+        for(; i < n; ++i){
+            uint32_t v = (uint32_t)x[i] << 16;
+            memcpy(y + i, &v, sizeof(float));
+        }
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    if(has_f16c()) i = fp16_to_float_f16c(n, x, y);
+#endif
+    for(; i < n; ++i) y[i] = fp16_to_float(x[i]);
+}
@@ -1,4 +1,5 @@
 #include "box.h"
+#include "thread_pool.h"
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
@@ -55,9 +56,59 @@ void do_nms_obj(detection *dets, int total, int classes, float thresh)
 }
 
 
-void do_nms_sort(detection *dets, int total, int classes, float thresh)
+typedef struct {
+    detection *dets;
+    int total;
+    float thresh;
+} nms_job;
+
+typedef struct {
+    float prob;
+    int index;
+} nms_entry;
+
+static int nms_entry_comparator(const void *pa, const void *pb)
+{
+    const nms_entry *a = (const nms_entry *)pa;
+    const nms_entry *b = (const nms_entry *)pb;
+    if(a->prob != b->prob) return (a->prob < b->prob) ? 1 : -1;
+    return a->index - b->index;
+}
+
+// Each class sorts its own list of candidates instead of the shared dets
+// array, so classes suppress independently of each other
+static void nms_classes(void *ptr, int begin, int end)
 {
+    nms_job *job = (nms_job *)ptr;
+    detection *dets = job->dets;
+    nms_entry *order = (nms_entry *)calloc(job->total, sizeof(nms_entry));
     int i, j, k;
+    for(k = begin; k < end; ++k){
+        int n = 0;
+        for(i = 0; i < job->total; ++i){
+            if(dets[i].prob[k] == 0) continue;
+            order[n].prob = dets[i].prob[k];
+            order[n].index = i;
+            ++n;
+        }
+        qsort(order, n, sizeof(nms_entry), nms_entry_comparator);
+        for(i = 0; i < n; ++i){
+            detection *a = dets + order[i].index;
+            if(a->prob[k] == 0) continue;
+            for(j = i+1; j < n; ++j){
+                detection *b = dets + order[j].index;
+                if (box_iou(a->bbox, b->bbox) > job->thresh){
+                    b->prob[k] = 0;
+                }
+            }
+        }
+    }
+    free(order);
+}
+
+void do_nms_sort(detection *dets, int total, int classes, float thresh)
+{
+    int i, k;
     k = total-1;
     for(i = 0; i <= k; ++i){
         if(dets[i].objectness == 0){
@@ -70,22 +121,8 @@ void do_nms_sort(detection *dets, int total, int classes, float thresh)
     }
     total = k+1;
 
-    for(k = 0; k < classes; ++k){
-        for(i = 0; i < total; ++i){
-            dets[i].sort_class = k;
-        }
-        qsort(dets, total, sizeof(detection), nms_comparator);
-        for(i = 0; i < total; ++i){
-            if(dets[i].prob[k] == 0) continue;
-            box a = dets[i].bbox;
-            for(j = i+1; j < total; ++j){
-                box b = dets[j].bbox;
-                if (box_iou(a, b) > thresh){
-                    dets[j].prob[k] = 0;
-                }
-            }
-        }
-    }
+    nms_job job = {dets, total, thresh};
+    parallel_for(classes, 1, nms_classes, &job);
 }
 
 box float_to_box(float *f, int stride)
@@ -5,13 +5,14 @@
 #include "cuda.h"
 #include "blas.h"
 #include "gemm.h"
+#include "quantize.h"
 
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activation, int batch_normalize, int adam)
+layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activation, int batch_normalize, int adam, int train)
 {
     int i;
     layer l = {0};
@@ -30,10 +31,12 @@ layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activa
     l.out_c = outputs;
 
     l.output = calloc(batch*outputs, sizeof(float));
-    l.delta = calloc(batch*outputs, sizeof(float));
+    if(train){
+        l.delta = calloc(batch*outputs, sizeof(float));
 
-    l.weight_updates = calloc(inputs*outputs, sizeof(float));
-    l.bias_updates = calloc(outputs, sizeof(float));
+        l.weight_updates = calloc(inputs*outputs, sizeof(float));
+        l.bias_updates = calloc(outputs, sizeof(float));
+    }
 
     l.weights = calloc(outputs*inputs, sizeof(float));
     l.biases = calloc(outputs, sizeof(float));
@@ -44,7 +47,7 @@ layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activa
 
     //float scale = 1./sqrt(inputs);
     float scale = sqrt(2./inputs);
-    for(i = 0; i < outputs*inputs; ++i){
+    for(i = 0; i < outputs*inputs && train; ++i){
         l.weights[i] = scale*rand_uniform(-1, 1);
     }
 
@@ -52,7 +55,7 @@ layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activa
         l.biases[i] = 0;
     }
 
-    if(adam){
+    if(adam && train){
         l.m = calloc(l.inputs*l.outputs, sizeof(float));
         l.v = calloc(l.inputs*l.outputs, sizeof(float));
         l.bias_m = calloc(l.outputs, sizeof(float));
@@ -62,19 +65,21 @@ layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activa
     }
     if(batch_normalize){
         l.scales = calloc(outputs, sizeof(float));
-        l.scale_updates = calloc(outputs, sizeof(float));
         for(i = 0; i < outputs; ++i){
             l.scales[i] = 1;
         }
 
+        l.rolling_mean = calloc(outputs, sizeof(float));
+        l.rolling_variance = calloc(outputs, sizeof(float));
+    }
+    if(batch_normalize && train){
+        l.scale_updates = calloc(outputs, sizeof(float));
+
         l.mean = calloc(outputs, sizeof(float));
         l.mean_delta = calloc(outputs, sizeof(float));
         l.variance = calloc(outputs, sizeof(float));
         l.variance_delta = calloc(outputs, sizeof(float));
 
-        l.rolling_mean = calloc(outputs, sizeof(float));
-        l.rolling_variance = calloc(outputs, sizeof(float));
-
         l.x = calloc(batch*outputs, sizeof(float));
         l.x_norm = calloc(batch*outputs, sizeof(float));
     }
@@ -146,10 +151,45 @@ void update_connected_layer(layer l, update_args a)
     axpy_cpu(l.inputs*l.outputs, -decay*batch, l.weights, 1, l.weight_updates, 1);
     axpy_cpu(l.inputs*l.outputs, learning_rate/batch, l.weight_updates, 1, l.weights, 1);
     scal_cpu(l.inputs*l.outputs, momentum, l.weight_updates, 1);
+    if(l.packed_weights) gemm_pack_b_matrix(1, l.inputs, l.outputs, l.weights, l.inputs, l.packed_weights);
+    if(l.int8_weights) quantize_weights_int8(l.weights, l.outputs, l.inputs, l.input_scale, l.int8_weights, l.int8_scales);
+}
+
+void optimize_connected_layer(layer *l, network *net)
+{
+    free(l->packed_weights);
+    free(l->int8_weights);
+    free(l->int8_scales);
+    l->packed_weights = 0;
+    l->int8_weights = 0;
+    l->int8_scales = 0;
+    if(l->input_scale > 0 && !net->train){
+        l->int8_weights = calloc(int8_packed_size(l->outputs, l->inputs), sizeof(int8_t));
+        l->int8_scales = calloc(l->outputs, sizeof(float));
+        quantize_weights_int8(l->weights, l->outputs, l->inputs, l->input_scale, l->int8_weights, l->int8_scales);
+        return;
+    }
+    // A single input row is a GEMV that already streams the plain rows once
+    if(!net->prepack || l->batch == 1) return;
+    l->packed_weights = gemm_packed_alloc(gemm_packed_b_size(l->inputs, l->outputs));
+    gemm_pack_b_matrix(1, l->inputs, l->outputs, l->weights, l->inputs, l->packed_weights);
 }
 
 void forward_connected_layer(layer l, network net)
 {
+    if(l.int8_weights){
+        int i;
+        gemm_epilogue ep = {0};
+        ep.scales = l.int8_scales;
+        ep.biases = l.biases;
+        ep.activation = l.activation;
+        // Each input row is a 1x1 convolution over a 1x1 image with l.inputs channels
+        for(i = 0; i < l.batch; ++i){
+            convolution_int8(net.input + i*l.inputs, l.inputs, 1, 1, 1, 1, 0, l.input_scale,
+                    l.int8_weights, l.outputs, &ep, l.output + i*l.outputs);
+        }
+        return;
+    }
     fill_cpu(l.outputs*l.batch, 0, l.output, 1);
     int m = l.batch;
     int k = l.inputs;
@@ -157,7 +197,8 @@ void forward_connected_layer(layer l, network net)
     float *a = net.input;
     float *b = l.weights;
     float *c = l.output;
-    gemm(0,1,m,n,k,1,a,k,b,k,1,c,n);
+    if(l.packed_weights) gemm_cpu_packed_b(0,m,n,k,1,a,k,l.packed_weights,c,n);
+    else gemm(0,1,m,n,k,1,a,k,b,k,1,c,n);
     if(l.batch_normalize){
         forward_batchnorm_layer(l, net);
     } else {
@@ -5,11 +5,12 @@
 #include "layer.h"
 #include "network.h"
 
-layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activation, int batch_normalize, int adam);
+layer make_connected_layer(int batch, int inputs, int outputs, ACTIVATION activation, int batch_normalize, int adam, int train);
 
 void forward_connected_layer(layer l, network net);
 void backward_connected_layer(layer l, network net);
 void update_connected_layer(layer l, update_args a);
+void optimize_connected_layer(layer *l, network *net);
 
 #ifdef GPU
 void forward_connected_layer_gpu(layer l, network net);
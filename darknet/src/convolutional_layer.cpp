@@ -5,6 +5,13 @@
 #include "col2im.h"
 #include "blas.h"
 #include "gemm.h"
+#include "winograd.h"
+#include "quantize.h"
+#include "xnor.h"
+#include "depthwise.h"
+#include "tuner.h"
+#include "thread_pool.h"
+#include "maxpool_layer.h"
 #include <stdio.h>
 #include <time.h>
 
@@ -173,7 +180,7 @@ void cudnn_convolutional_setup(layer *l)
 #endif
 #endif
 
-convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int n, int groups, int size, int stride, int padding, ACTIVATION activation, int batch_normalize, int binary, int xnor, int adam)
+convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int n, int groups, int size, int stride, int padding, ACTIVATION activation, int batch_normalize, int binary, int xnor, int adam, int train)
 {
     int i;
     convolutional_layer l = {0};
@@ -193,10 +200,11 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
     l.batch_normalize = batch_normalize;
 
     l.weights = calloc(c/groups*n*size*size, sizeof(float));
-    l.weight_updates = calloc(c/groups*n*size*size, sizeof(float));
-
     l.biases = calloc(n, sizeof(float));
-    l.bias_updates = calloc(n, sizeof(float));
+    if(train){
+        l.weight_updates = calloc(c/groups*n*size*size, sizeof(float));
+        l.bias_updates = calloc(n, sizeof(float));
+    }
 
     l.nweights = c/groups*n*size*size;
     l.nbiases = n;
@@ -206,7 +214,8 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
     //printf("convscale %f\n", scale);
     //scale = .02;
     //for(i = 0; i < c*n*size*size; ++i) l.weights[i] = scale*rand_uniform(-1, 1);
-    for(i = 0; i < l.nweights; ++i) l.weights[i] = scale*rand_normal();
+    // Inference networks leave them untouched for the weights file
+    if(train) for(i = 0; i < l.nweights; ++i) l.weights[i] = scale*rand_normal();
     int out_w = convolutional_out_width(l);
     int out_h = convolutional_out_height(l);
     l.out_h = out_h;
@@ -216,7 +225,7 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
     l.inputs = l.w * l.h * l.c;
 
     l.output = calloc(l.batch*l.outputs, sizeof(float));
-    l.delta  = calloc(l.batch*l.outputs, sizeof(float));
+    if(train) l.delta  = calloc(l.batch*l.outputs, sizeof(float));
 
     l.forward = forward_convolutional_layer;
     l.backward = backward_convolutional_layer;
@@ -233,23 +242,26 @@ convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int
 
     if(batch_normalize){
         l.scales = calloc(n, sizeof(float));
-        l.scale_updates = calloc(n, sizeof(float));
         for(i = 0; i < n; ++i){
             l.scales[i] = 1;
         }
 
+        l.rolling_mean = calloc(n, sizeof(float));
+        l.rolling_variance = calloc(n, sizeof(float));
+    }
+    if(batch_normalize && train){
+        l.scale_updates = calloc(n, sizeof(float));
+
         l.mean = calloc(n, sizeof(float));
         l.variance = calloc(n, sizeof(float));
 
         l.mean_delta = calloc(n, sizeof(float));
         l.variance_delta = calloc(n, sizeof(float));
 
-        l.rolling_mean = calloc(n, sizeof(float));
-        l.rolling_variance = calloc(n, sizeof(float));
         l.x = calloc(l.batch*l.outputs, sizeof(float));
         l.x_norm = calloc(l.batch*l.outputs, sizeof(float));
     }
-    if(adam){
+    if(adam && train){
         l.m = calloc(l.nweights, sizeof(float));
         l.v = calloc(l.nweights, sizeof(float));
         l.bias_m = calloc(n, sizeof(float));
@@ -345,7 +357,7 @@ void denormalize_convolutional_layer(convolutional_layer l)
 /*
 void test_convolutional_layer()
 {
-    convolutional_layer l = make_convolutional_layer(1, 5, 5, 3, 2, 5, 2, 1, LEAKY, 1, 0, 0, 0);
+    convolutional_layer l = make_convolutional_layer(1, 5, 5, 3, 2, 5, 2, 1, LEAKY, 1, 0, 0, 0, 1);
     l.batch_normalize = 1;
     float data[] = {1,1,1,1,1,
         1,1,1,1,1,
@@ -381,8 +393,8 @@ void resize_convolutional_layer(convolutional_layer *l, int w, int h)
     l->inputs = l->w * l->h * l->c;
 
     l->output = realloc(l->output, l->batch*l->outputs*sizeof(float));
-    l->delta  = realloc(l->delta,  l->batch*l->outputs*sizeof(float));
-    if(l->batch_normalize){
+    if(l->delta) l->delta  = realloc(l->delta,  l->batch*l->outputs*sizeof(float));
+    if(l->batch_normalize && l->x){
         l->x = realloc(l->x, l->batch*l->outputs*sizeof(float));
         l->x_norm  = realloc(l->x_norm, l->batch*l->outputs*sizeof(float));
     }
@@ -408,79 +420,333 @@ void resize_convolutional_layer(convolutional_layer *l, int w, int h)
     l->workspace_size = get_workspace_size(*l);
 }
 
-void add_bias(float *output, float *biases, int batch, int n, int size)
+void backward_bias(float *bias_updates, float *delta, int batch, int n, int size)
 {
-    int i,j,b;
+    int i,b;
     for(b = 0; b < batch; ++b){
         for(i = 0; i < n; ++i){
-            for(j = 0; j < size; ++j){
-                output[(b*n + i)*size + j] += biases[i];
-            }
+            bias_updates[i] += sum_array(delta+size*(i+b*n), size);
         }
     }
 }
 
-void scale_bias(float *output, float *scales, int batch, int n, int size)
+static int winograd_convolutional_layer(convolutional_layer l)
 {
-    int i,j,b;
-    for(b = 0; b < batch; ++b){
-        for(i = 0; i < n; ++i){
-            for(j = 0; j < size; ++j){
-                output[(b*n + i)*size + j] *= scales[i];
+    return l.size == 3 && l.stride == 1 && l.groups == 1 && !l.binary && !l.xnor;
+}
+
+static int depthwise_convolutional_layer(convolutional_layer l)
+{
+    return l.groups == l.c && l.n == l.c && l.groups > 1 && !l.binary && !l.xnor && !l.half_weights;
+}
+
+static CONV_ALGO pick_convolutional_algo(convolutional_layer l)
+{
+    if(depthwise_convolutional_layer(l)) return CONV_DEPTHWISE;
+    // Winograd weights are 4x larger and every output tile pays for the
+    // input/output transforms, so it only wins on wide, high resolution layers
+    int tiles = ((l.out_w + 3)/4) * ((l.out_h + 3)/4);
+    if(winograd_convolutional_layer(l) && l.c >= 32 && l.n >= 32 && tiles >= 36) return CONV_WINOGRAD;
+    return CONV_GEMM;
+}
+
+static void transform_convolutional_weights(convolutional_layer l)
+{
+    int i, j;
+    int m = l.n/l.groups;
+    int k = l.nweights/l.n;
+    float *source = l.weights;
+    if(l.half_weights){
+        source = calloc(l.nweights, sizeof(float));
+        half_to_float_cpu(l.nweights, l.weight_format, l.half_weights, source);
+    }
+    float *weights = source;
+    if(l.fused_biases){
+        if(!l.fused_scales) weights = calloc(l.nweights, sizeof(float));
+        for(i = 0; i < l.n; ++i){
+            float scale = l.scales[i]/(sqrt(l.rolling_variance[i]) + .000001f);
+            l.fused_biases[i] = l.biases[i] - l.rolling_mean[i]*scale;
+            if(l.fused_scales) l.fused_scales[i] = scale;
+            else for(j = 0; j < k; ++j) weights[i*k + j] = source[i*k + j]*scale;
+        }
+    }
+    if(l.int8_weights){
+        quantize_weights_int8(weights, l.n, k, l.input_scale, l.int8_weights, l.int8_scales);
+    } else if(l.xnor_weights){
+        binarize_weights_xnor(weights, l.n, l.c, l.size, l.xnor_weights, l.xnor_scales);
+    } else if(l.algo == CONV_WINOGRAD){
+        if(l.packed_weights){
+            float *u = calloc(36*l.n*l.c, sizeof(float));
+            winograd_transform_weights(weights, l.n, l.c, u);
+            for(j = 0; j < 36; ++j){
+                gemm_pack_a_matrix(l.n, l.c, u + j*l.n*l.c, l.c, l.packed_weights + j*gemm_packed_a_size(l.n, l.c));
             }
+            free(u);
+        } else {
+            winograd_transform_weights(weights, l.n, l.c, l.winograd_weights);
+        }
+    } else if(l.packed_weights){
+        for(j = 0; j < l.groups; ++j){
+            gemm_pack_a_matrix(m, k, weights + j*l.nweights/l.groups, k, l.packed_weights + j*gemm_packed_a_size(m, k));
         }
     }
+    if(weights != source) free(weights);
+    if(source != l.weights) free(source);
 }
 
-void backward_bias(float *bias_updates, float *delta, int batch, int n, int size)
+// Weights are kept only in fp16/bf16 from here on; the GEMM widens them to
+// fp32 while packing, so this is for inference only
+void set_convolutional_weight_format(convolutional_layer *l, WEIGHT_FORMAT format)
 {
-    int i,b;
-    for(b = 0; b < batch; ++b){
-        for(i = 0; i < n; ++i){
-            bias_updates[i] += sum_array(delta+size*(i+b*n), size);
-        }
+    if(format == WEIGHTS_FP32 || l->binary || l->xnor || l->half_weights) return;
+    l->weight_format = format;
+    l->half_weights = calloc(l->nweights, sizeof(uint16_t));
+    float_to_half_cpu(l->nweights, format, l->weights, l->half_weights);
+    free(l->weights);
+    l->weights = 0;
+}
+
+void prepare_convolutional_layer(convolutional_layer *l, network *net, CONV_ALGO algo)
+{
+    if(algo == CONV_AUTO || algo == CONV_TUNE) algo = pick_convolutional_algo(*l);
+    if(algo == CONV_WINOGRAD && (!winograd_convolutional_layer(*l) || l->half_weights)) algo = CONV_GEMM;
+    if(algo == CONV_DEPTHWISE && !depthwise_convolutional_layer(*l)) algo = CONV_GEMM;
+    l->algo = algo;
+    int int8 = l->input_scale > 0 && !net->train;
+    int xnor = l->xnor && l->groups == 1 && !net->train;
+
+    free(l->winograd_weights);
+    free(l->packed_weights);
+    free(l->fused_scales);
+    free(l->fused_biases);
+    free(l->int8_weights);
+    free(l->int8_scales);
+    free(l->xnor_weights);
+    free(l->xnor_scales);
+    l->winograd_weights = 0;
+    l->packed_weights = 0;
+    l->fused_scales = 0;
+    l->fused_biases = 0;
+    l->int8_weights = 0;
+    l->int8_scales = 0;
+    l->xnor_weights = 0;
+    l->xnor_scales = 0;
+    if(xnor){
+        l->xnor_weights = xnor_packed_alloc(xnor_packed_size(l->n, l->c, l->size));
+        l->xnor_scales = calloc(l->n, sizeof(float));
+    } else if(int8){
+        l->int8_weights = calloc(int8_packed_size(l->n, l->nweights/l->n), sizeof(int8_t));
+        l->int8_scales = calloc(l->n, sizeof(float));
+    } else if(net->prepack && !l->binary && !l->xnor && !l->half_weights && algo != CONV_DEPTHWISE){
+        if(algo == CONV_WINOGRAD) l->packed_weights = gemm_packed_alloc(36*gemm_packed_a_size(l->n, l->c));
+        else l->packed_weights = gemm_packed_alloc(l->groups*gemm_packed_a_size(l->n/l->groups, l->nweights/l->n));
+    } else if(algo == CONV_WINOGRAD){
+        l->winograd_weights = calloc(36*l->n*l->c, sizeof(float));
     }
+
+    // Rolling statistics are constant at inference, so batch norm reduces to
+    // a per-filter scale, folded into the transformed weights when there are
+    // any, and a bias
+    if(l->batch_normalize && !net->train){
+        l->fused_biases = calloc(l->n, sizeof(float));
+        if(!l->packed_weights && !l->winograd_weights && !l->int8_weights && !l->xnor_weights) l->fused_scales = calloc(l->n, sizeof(float));
+        free(l->x);
+        free(l->x_norm);
+        l->x = 0;
+        l->x_norm = 0;
+    }
+    transform_convolutional_weights(*l);
 }
 
-void forward_convolutional_layer(convolutional_layer l, network net)
+void optimize_convolutional_layer(convolutional_layer *l, network *net)
 {
-    int i, j;
+    CONV_ALGO algo = net->conv_algo;
+    if(algo == CONV_TUNE) algo = tune_convolutional_layer(l, net);
+    prepare_convolutional_layer(l, net, algo);
+}
 
-    fill_cpu(l.outputs*l.batch, 0, l.output, 1);
+typedef struct {
+    float *im;
+    int c, h, w;
+    int size, stride, pad;
+    size_t batch_stride;
+} convolutional_input;
 
-    if(l.xnor){
-        binarize_weights(l.weights, l.n, l.c/l.groups*l.size*l.size, l.binary_weights);
-        swap_binary(&l);
-        binarize_cpu(net.input, l.c*l.h*l.w*l.batch, l.binary_input);
-        net.input = l.binary_input;
-    }
+static void pack_convolutional_input(void *b, int k, int kc, int j, int nc, int nr, float *buf)
+{
+    convolutional_input *in = (convolutional_input *)b;
+    im2col_panels_batch_cpu(in->im, in->batch_stride, in->c, in->h, in->w, in->size, in->stride, in->pad, k, kc, j, nc, nr, buf);
+}
+
+static gemm_epilogue offset_epilogue(gemm_epilogue ep, int offset, int row)
+{
+    if(ep.scales) ep.scales += row;
+    if(ep.biases) ep.biases += row;
+    if(ep.add) ep.add += offset;
+    return ep;
+}
+
+// Pools channels [c0, c1) of image i as soon as the conv has written them
+static void pool_fused_channels(convolutional_layer l, int i, int c0, int c1)
+{
+    if(l.fused_maxpool) maxpool_cpu(*l.fused_maxpool, l.output, i*l.n + c0, i*l.n + c1, 0);
+}
+
+typedef struct {
+    convolutional_layer *l;
+    network *net;
+    float *output;
+    gemm_epilogue *epilogue;
+    int fuse;
+} convolutional_groups;
 
+static void forward_convolutional_groups(void *ptr, int begin, int end)
+{
+    convolutional_groups *job = (convolutional_groups *)ptr;
+    convolutional_layer l = *job->l;
+    network net = *job->net;
     int m = l.n/l.groups;
     int k = l.size*l.size*l.c/l.groups;
     int n = l.out_w*l.out_h;
-    for(i = 0; i < l.batch; ++i){
-        for(j = 0; j < l.groups; ++j){
-            float *a = l.weights + j*l.nweights/l.groups;
-            float *b = net.workspace;
-            float *c = l.output + (i*l.groups + j)*n*m;
-            float *im =  net.input + (i*l.groups + j)*l.c/l.groups*l.h*l.w;
-
-            if (l.size == 1) {
+    int direct = l.size == 1 && l.stride == 1 && l.pad == 0;
+    int g;
+    for(g = begin; g < end; ++g){
+        int i = g/l.groups;
+        int j = g%l.groups;
+        float *a = l.weights ? l.weights + j*l.nweights/l.groups : 0;
+        uint16_t *ha = l.half_weights ? l.half_weights + j*l.nweights/l.groups : 0;
+        float *pa = l.packed_weights ? l.packed_weights + j*gemm_packed_a_size(m, k) : 0;
+        float *b = net.workspace;
+        float *c = job->output + (i*l.groups + j)*n*m;
+        float *im =  net.input + (i*l.groups + j)*l.c/l.groups*l.h*l.w;
+        gemm_epilogue ep = offset_epilogue(*job->epilogue, (i*l.groups + j)*n*m, j*m);
+        gemm_epilogue *epp = job->fuse ? &ep : 0;
+
+        if (direct || l.algo == CONV_IM2COL) {
+            if (direct) {
                 b = im;
             } else {
                 im2col_cpu(im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, b);
             }
-            gemm(0,0,m,n,k,1,a,k,b,n,1,c,n);
+            if (pa) {
+                gemm_cpu_packed_a(m,n,k,pa,0,b,n,epp,c,n);
+            } else if (ha) {
+                gemm_b_matrix bm = {0, b, n};
+                gemm_cpu_half(m,n,k,ha,k,l.weight_format,gemm_pack_b_source,&bm,epp,c,n);
+            } else {
+                gemm(0,0,m,n,k,1,a,k,b,n,1,c,n);
+                if (epp) gemm_apply_epilogue(epp, 0, m, 0, n, c, n);
+            }
+        } else {
+            convolutional_input in = {im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad};
+            if (ha) gemm_cpu_half(m,n,k,ha,k,l.weight_format,pack_convolutional_input,&in,epp,c,n);
+            else gemm_cpu_implicit(0,m,n,k,1,a,k,pa,pack_convolutional_input,&in,epp,c,n);
         }
+        pool_fused_channels(l, i, j*m, (j + 1)*m);
     }
+}
 
-    if(l.batch_normalize){
-        forward_batchnorm_layer(l, net);
+// A batch runs as one GEMM per group, the columns of every image packed side
+// by side, so each block of weights is loaded once for all the images
+static void forward_convolutional_batch(void *ptr, int begin, int end)
+{
+    convolutional_groups *job = (convolutional_groups *)ptr;
+    convolutional_layer l = *job->l;
+    network net = *job->net;
+    int m = l.n/l.groups;
+    int k = l.size*l.size*l.c/l.groups;
+    int n = l.out_w*l.out_h;
+    gemm_c_batch cb = {n, (size_t)l.outputs};
+    int i, j;
+    for(j = begin; j < end; ++j){
+        float *a = l.weights ? l.weights + j*l.nweights/l.groups : 0;
+        uint16_t *ha = l.half_weights ? l.half_weights + j*l.nweights/l.groups : 0;
+        float *pa = l.packed_weights ? l.packed_weights + j*gemm_packed_a_size(m, k) : 0;
+        float *im = net.input + j*l.c/l.groups*l.h*l.w;
+        gemm_epilogue ep = offset_epilogue(*job->epilogue, j*n*m, j*m);
+        convolutional_input in = {im, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, (size_t)l.inputs};
+        gemm_cpu_batch(m, n*l.batch, k, a, k, pa, ha, l.weight_format, pack_convolutional_input, &in,
+                job->fuse ? &ep : 0, job->output + j*n*m, n, &cb);
+        for(i = 0; i < l.batch; ++i) pool_fused_channels(l, i, j*m, (j + 1)*m);
+    }
+}
+
+void forward_convolutional_layer(convolutional_layer l, network net)
+{
+    int i;
+    // Without folded statistics batch norm needs the whole output, so the
+    // bias and activation can only run as separate passes
+    int fuse = !l.batch_normalize || l.fused_biases;
+    float *output = l.output;
+    gemm_epilogue epilogue = {0};
+
+    if(fuse){
+        epilogue.scales = l.int8_weights ? l.int8_scales : (l.xnor_weights ? l.xnor_scales : l.fused_scales);
+        epilogue.biases = l.fused_biases ? l.fused_biases : l.biases;
+        epilogue.activation = l.activation;
+        if(l.fused_shortcut){
+            layer s = *l.fused_shortcut;
+            output = s.output;
+            epilogue.add = net.layers[s.index].output;
+            epilogue.alpha = s.alpha;
+            epilogue.beta = s.beta;
+            epilogue.add_activation = s.activation;
+        }
+    }
+
+    if(l.int8_weights){
+        for(i = 0; i < l.batch; ++i){
+            gemm_epilogue ep = offset_epilogue(epilogue, i*l.outputs, 0);
+            convolution_int8(net.input + i*l.inputs, l.c, l.h, l.w, l.size, l.stride, l.pad, l.input_scale,
+                    l.int8_weights, l.n, &ep, output + i*l.outputs);
+            pool_fused_channels(l, i, 0, l.n);
+        }
+    } else if(l.xnor_weights){
+        for(i = 0; i < l.batch; ++i){
+            gemm_epilogue ep = offset_epilogue(epilogue, i*l.outputs, 0);
+            convolution_xnor(net.input + i*l.inputs, l.c, l.h, l.w, l.size, l.stride, l.pad,
+                    l.xnor_weights, l.n, &ep, output + i*l.outputs);
+            pool_fused_channels(l, i, 0, l.n);
+        }
+    } else if(l.algo == CONV_DEPTHWISE){
+        for(i = 0; i < l.batch; ++i){
+            gemm_epilogue ep = offset_epilogue(epilogue, i*l.outputs, 0);
+            depthwise_convolution(net.input + i*l.inputs, l.c, l.h, l.w, l.size, l.stride, l.pad,
+                    l.weights, fuse ? &ep : 0, output + i*l.outputs);
+            pool_fused_channels(l, i, 0, l.n);
+        }
+    } else if(l.algo == CONV_WINOGRAD){
+        for(i = 0; i < l.batch; ++i){
+            gemm_epilogue ep = offset_epilogue(epilogue, i*l.outputs, 0);
+            float *im = net.input + i*l.inputs;
+            if(l.packed_weights) winograd_convolution_packed(im, l.c, l.h, l.w, l.pad, l.packed_weights, l.n, fuse ? &ep : 0, output + i*l.outputs);
+            else winograd_convolution(im, l.c, l.h, l.w, l.pad, l.winograd_weights, l.n, fuse ? &ep : 0, output + i*l.outputs);
+            pool_fused_channels(l, i, 0, l.n);
+        }
     } else {
-        add_bias(l.output, l.biases, l.batch, l.n, l.out_h*l.out_w);
+        fill_cpu(l.outputs*l.batch, 0, output, 1);
+
+        if(l.xnor){
+            binarize_weights(l.weights, l.n, l.c/l.groups*l.size*l.size, l.binary_weights);
+            swap_binary(&l);
+            binarize_cpu(net.input, l.c*l.h*l.w*l.batch, l.binary_input);
+            net.input = l.binary_input;
+        }
+
+        // Each group is its own small GEMM, so with groups they run side by
+        // side, unless they would share the explicit im2col workspace
+        int direct = l.size == 1 && l.stride == 1 && l.pad == 0;
+        int shared = !direct && l.algo == CONV_IM2COL;
+        convolutional_groups job = {&l, &net, output, &epilogue, fuse};
+        if(l.batch > 1) parallel_for(l.groups, 1, forward_convolutional_batch, &job);
+        else if(l.groups > 1 && !shared) parallel_for(l.batch*l.groups, 1, forward_convolutional_groups, &job);
+        else forward_convolutional_groups(&job, 0, l.batch*l.groups);
     }
 
-    activate_array(l.output, l.outputs*l.batch, l.activation);
+    if(!fuse){
+        forward_batchnorm_layer(l, net);
+        activate_array(l.output, l.outputs*l.batch, l.activation);
+    }
     if(l.binary || l.xnor) swap_binary(&l);
 }
 
@@ -490,6 +756,7 @@ void backward_convolutional_layer(convolutional_layer l, network net)
     int m = l.n/l.groups;
     int n = l.size*l.size*l.c/l.groups;
     int k = l.out_w*l.out_h;
+    int direct = l.size == 1 && l.stride == 1 && l.pad == 0;
 
     gradient_array(l.output, l.outputs*l.batch, l.activation, l.delta);
 
@@ -508,7 +775,7 @@ void backward_convolutional_layer(convolutional_layer l, network net)
             float *im  = net.input + (i*l.groups + j)*l.c/l.groups*l.h*l.w;
             float *imd = net.delta + (i*l.groups + j)*l.c/l.groups*l.h*l.w;
 
-            if(l.size == 1){
+            if(direct){
                 b = im;
             } else {
                 im2col_cpu(im, l.c/l.groups, l.h, l.w, 
@@ -521,13 +788,13 @@ void backward_convolutional_layer(convolutional_layer l, network net)
                 a = l.weights + j*l.nweights/l.groups;
                 b = l.delta + (i*l.groups + j)*m*k;
                 c = net.workspace;
-                if (l.size == 1) {
+                if (direct) {
                     c = imd;
                 }
 
                 gemm(1,0,n,k,m,1,a,n,b,k,0,c,k);
 
-                if (l.size != 1) {
+                if (!direct) {
                     col2im_cpu(net.workspace, l.c/l.groups, l.h, l.w, l.size, l.stride, l.pad, imd);
                 }
             }
@@ -553,6 +820,8 @@ void update_convolutional_layer(convolutional_layer l, update_args a)
     axpy_cpu(l.nweights, -decay*batch, l.weights, 1, l.weight_updates, 1);
     axpy_cpu(l.nweights, learning_rate/batch, l.weight_updates, 1, l.weights, 1);
     scal_cpu(l.nweights, momentum, l.weight_updates, 1);
+
+    if(l.winograd_weights || l.packed_weights || l.fused_biases || l.int8_weights || l.xnor_weights) transform_convolutional_weights(l);
 }
 
 
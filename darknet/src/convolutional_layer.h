@@ -25,8 +25,11 @@ void cudnn_convolutional_setup(layer *l);
 #endif
 #endif
 
-convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int n, int groups, int size, int stride, int padding, ACTIVATION activation, int batch_normalize, int binary, int xnor, int adam);
+convolutional_layer make_convolutional_layer(int batch, int h, int w, int c, int n, int groups, int size, int stride, int padding, ACTIVATION activation, int batch_normalize, int binary, int xnor, int adam, int train);
 void resize_convolutional_layer(convolutional_layer *layer, int w, int h);
+void set_convolutional_weight_format(convolutional_layer *l, WEIGHT_FORMAT format);
+void prepare_convolutional_layer(convolutional_layer *l, network *net, CONV_ALGO algo);
+void optimize_convolutional_layer(convolutional_layer *layer, network *net);
 void forward_convolutional_layer(const convolutional_layer layer, network net);
 void update_convolutional_layer(convolutional_layer layer, update_args a);
 image *visualize_convolutional_layer(convolutional_layer layer, char *window, image *prev_weights);
@@ -36,7 +39,6 @@ void binarize_weights2(float *weights, int n, int size, char *binary, float *sca
 
 void backward_convolutional_layer(convolutional_layer layer, network net);
 
-void add_bias(float *output, float *biases, int batch, int n, int size);
 void backward_bias(float *bias_updates, float *delta, int batch, int n, int size);
 
 image get_convolutional_image(convolutional_layer layer);
@@ -195,7 +195,9 @@ void demo(char *cfgfile, char *weightfile, float thresh, int cam_index, const ch
     demo_hier = hier;
     printf("Demo\n");
     net = load_network(cfgfile, weightfile, 0);
+    if(net->threads) set_thread_pool_threads(net->threads);
     set_batch_network(net, 1);
+    optimize_network(net);
     pthread_t detect_thread;
     pthread_t fetch_thread;
 
@@ -0,0 +1,110 @@
+#include "depthwise.h"
+#include "thread_pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Direct depthwise convolution, one filter per channel. Every tap of the
+ * kernel adds a scaled, strided input row to the output row, clipped to the
+ * columns where it falls inside the image, so padding never needs a
+ * bounds check in the inner loop and each output row stays in L1.
+ */
+
+typedef void (*depthwise_row_fn)(int n, float w, const float *in, int stride, float *out);
+
+static void depthwise_row_generic(int n, float w, const float *in, int stride, float *out)
+{
+    int i;
+    for(i = 0; i < n; ++i) out[i] += w*in[i*stride];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2,fma")))
+static void depthwise_row_avx2(int n, float w, const float *in, int stride, float *out)
+{
+    __m256 wv = _mm256_set1_ps(w);
+    int i = 0;
+    if(stride == 1){
+        for(; i + 8 <= n; i += 8){
+            _mm256_storeu_ps(out + i, _mm256_fmadd_ps(wv, _mm256_loadu_ps(in + i), _mm256_loadu_ps(out + i)));
+        }
+    } else if(stride == 2){
+        // The last load reaches one float past the final input, so stop short
+        for(; i + 9 <= n; i += 8){
+            // Even lanes of 16 inputs, restored to order across the 128 bit halves
+            __m256 lo = _mm256_loadu_ps(in + 2*i);
+            __m256 hi = _mm256_loadu_ps(in + 2*i + 8);
+            __m256 even = _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+            even = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(even), _MM_SHUFFLE(3, 1, 2, 0)));
+            _mm256_storeu_ps(out + i, _mm256_fmadd_ps(wv, even, _mm256_loadu_ps(out + i)));
+        }
+    }
+    for(; i < n; ++i) out[i] += w*in[i*stride];
+}
+#endif
+
+static depthwise_row_fn get_depthwise_row()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static depthwise_row_fn row = (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) ?
+        depthwise_row_avx2 : depthwise_row_generic;
+    return row;
+#else
+    return depthwise_row_generic;
+#endif
+}
+
+static void depthwise_channel(const float *im, int h, int w, int size, int stride, int pad,
+        const float *k, depthwise_row_fn row, float *out)
+{
+    int out_h = (h + 2*pad - size)/stride + 1;
+    int out_w = (w + 2*pad - size)/stride + 1;
+    int y, ky, kx;
+    for(y = 0; y < out_h; ++y){
+        float *o = out + y*out_w;
+        memset(o, 0, out_w*sizeof(float));
+        for(ky = 0; ky < size; ++ky){
+            int iy = y*stride + ky - pad;
+            if(iy < 0 || iy >= h) continue;
+            const float *in = im + iy*w;
+            for(kx = 0; kx < size; ++kx){
+                int off = kx - pad;
+                int x0 = off < 0 ? (-off + stride - 1)/stride : 0;
+                int x1 = (w - 1 - off < 0) ? 0 : (w - 1 - off)/stride + 1;
+                if(x1 > out_w) x1 = out_w;
+                if(x0 < x1) row(x1 - x0, k[ky*size + kx], in + x0*stride + off, stride, o + x0);
+            }
+        }
+    }
+}
+
+typedef struct {
+    float *im;
+    int h, w, size, stride, pad;
+    float *weights;
+    const gemm_epilogue *ep;
+    depthwise_row_fn row;
+    float *out;
+} depthwise_job;
+
+static void depthwise_channels(void *ptr, int begin, int end)
+{
+    depthwise_job *d = (depthwise_job *)ptr;
+    int n = ((d->h + 2*d->pad - d->size)/d->stride + 1)*((d->w + 2*d->pad - d->size)/d->stride + 1);
+    int i;
+    for(i = begin; i < end; ++i){
+        float *out = d->out + (size_t)i*n;
+        depthwise_channel(d->im + (size_t)i*d->h*d->w, d->h, d->w, d->size, d->stride, d->pad,
+                d->weights + i*d->size*d->size, d->row, out);
+        if(d->ep) gemm_apply_epilogue(d->ep, i, 1, 0, n, out, n);
+    }
+}
+
+void depthwise_convolution(float *im, int c, int h, int w, int size, int stride, int pad,
+        float *weights, const gemm_epilogue *ep, float *out)
+{
+    depthwise_job d = {im, h, w, size, stride, pad, weights, ep, get_depthwise_row(), out};
+    parallel_for(c, 1, depthwise_channels, &d);
+}
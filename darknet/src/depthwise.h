@@ -0,0 +1,9 @@
+#ifndef DEPTHWISE_H
+#define DEPTHWISE_H
+
+#include "gemm.h"
+
+void depthwise_convolution(float *im, int c, int h, int w, int size, int stride, int pad,
+        float *weights, const gemm_epilogue *ep, float *out);
+
+#endif
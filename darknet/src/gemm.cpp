@@ -1,9 +1,12 @@
 #include "gemm.h"
 #include "utils.h"
+#include "blas.h"
+#include "thread_pool.h"
 #include "cuda.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 
 void gemm_bin(int M, int N, int K, float ALPHA, 
         char  *A, int lda, 
@@ -77,7 +80,6 @@ void gemm_nn(int M, int N, int K, float ALPHA,
         float *C, int ldc)
 {
     int i,j,k;
-    #pragma omp parallel for
     for(i = 0; i < M; ++i){
         for(k = 0; k < K; ++k){
             register float A_PART = ALPHA*A[i*lda+k];
@@ -94,7 +96,6 @@ void gemm_nt(int M, int N, int K, float ALPHA,
         float *C, int ldc)
 {
     int i,j,k;
-    #pragma omp parallel for
     for(i = 0; i < M; ++i){
         for(j = 0; j < N; ++j){
             register float sum = 0;
@@ -112,7 +113,6 @@ void gemm_tn(int M, int N, int K, float ALPHA,
         float *C, int ldc)
 {
     int i,j,k;
-    #pragma omp parallel for
     for(i = 0; i < M; ++i){
         for(k = 0; k < K; ++k){
             register float A_PART = ALPHA*A[k*lda+i];
@@ -129,7 +129,6 @@ void gemm_tt(int M, int N, int K, float ALPHA,
         float *C, int ldc)
 {
     int i,j,k;
-    #pragma omp parallel for
     for(i = 0; i < M; ++i){
         for(j = 0; j < N; ++j){
             register float sum = 0;
@@ -142,6 +141,577 @@ void gemm_tt(int M, int N, int K, float ALPHA,
 }
 
 
+/*
+ * Blocked GEMM. C is walked in NC-wide column blocks, K in KC-deep slices and
+ * M in MC-high row blocks; the B slice is packed into NR-wide panels and the
+ * A block (with ALPHA folded in) into MR-high panels so the micro-kernel only
+ * streams contiguous, zero padded memory. Edge tiles go through a scratch tile.
+ */
+
+#define GEMM_ALIGN 64
+
+static float *gemm_buffer(float **buf, size_t *size, size_t n)
+{
+    if(n > *size){
+        if(!*size) free_at_thread_exit((void **)buf);
+        free(*buf);
+        *buf = 0;
+        if(posix_memalign((void **)buf, GEMM_ALIGN, n*sizeof(float))) error("GEMM pack buffer allocation failed");
+        *size = n;
+    }
+    return *buf;
+}
+
+static void gemm_pack_a(int TA, int mc, int kc, int mr, float ALPHA, float *A, int lda, float *buf)
+{
+    int i, p, k;
+    for(p = 0; p < mc; p += mr){
+        int rows = (mc - p < mr) ? mc - p : mr;
+        for(k = 0; k < kc; ++k){
+            for(i = 0; i < rows; ++i){
+                buf[i] = ALPHA*(TA ? A[k*lda + p + i] : A[(p + i)*lda + k]);
+            }
+            for(; i < mr; ++i) buf[i] = 0;
+            buf += mr;
+        }
+    }
+}
+
+// Half precision A is widened one row segment at a time, so full precision
+// weights never exist outside the pack buffer
+static void gemm_pack_a_half(int mc, int kc, int mr, WEIGHT_FORMAT format, const uint16_t *A, int lda, float *buf)
+{
+    static thread_local float *row = 0;
+    static thread_local size_t row_size = 0;
+    int i, p, k;
+    float *r = gemm_buffer(&row, &row_size, kc);
+    for(p = 0; p < mc; p += mr){
+        int rows = (mc - p < mr) ? mc - p : mr;
+        for(i = 0; i < mr; ++i){
+            if(i < rows) half_to_float_cpu(kc, format, A + (p + i)*lda, r);
+            for(k = 0; k < kc; ++k) buf[k*mr + i] = (i < rows) ? r[k] : 0;
+        }
+        buf += kc*mr;
+    }
+}
+
+static void gemm_pack_b(int TB, int kc, int nc, int nr, float *B, int ldb, float *buf)
+{
+    int j, p, k;
+    for(p = 0; p < nc; p += nr){
+        int cols = (nc - p < nr) ? nc - p : nr;
+        for(k = 0; k < kc; ++k){
+            if(!TB && cols == nr){
+                memcpy(buf, B + k*ldb + p, nr*sizeof(float));
+            } else {
+                for(j = 0; j < cols; ++j){
+                    buf[j] = TB ? B[(p + j)*ldb + k] : B[k*ldb + p + j];
+                }
+                for(; j < nr; ++j) buf[j] = 0;
+            }
+            buf += nr;
+        }
+    }
+}
+
+static void gemm_kernel_generic_4x8(int k, const float *a, const float *b, float *c, int ldc)
+{
+    float acc[4][8] = {{0}};
+    int i, j, p;
+    for(p = 0; p < k; ++p){
+        for(i = 0; i < 4; ++i){
+            for(j = 0; j < 8; ++j){
+                acc[i][j] += a[i]*b[j];
+            }
+        }
+        a += 4;
+        b += 8;
+    }
+    for(i = 0; i < 4; ++i){
+        for(j = 0; j < 8; ++j){
+            c[i*ldc + j] += acc[i][j];
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static void gemm_kernel_sse_4x8(int k, const float *a, const float *b, float *c, int ldc)
+{
+    __m128 c00 = _mm_setzero_ps(), c01 = _mm_setzero_ps();
+    __m128 c10 = _mm_setzero_ps(), c11 = _mm_setzero_ps();
+    __m128 c20 = _mm_setzero_ps(), c21 = _mm_setzero_ps();
+    __m128 c30 = _mm_setzero_ps(), c31 = _mm_setzero_ps();
+    int p;
+    for(p = 0; p < k; ++p){
+        __m128 b0 = _mm_load_ps(b);
+        __m128 b1 = _mm_load_ps(b + 4);
+        __m128 a0 = _mm_set1_ps(a[0]);
+        __m128 a1 = _mm_set1_ps(a[1]);
+        __m128 a2 = _mm_set1_ps(a[2]);
+        __m128 a3 = _mm_set1_ps(a[3]);
+        c00 = _mm_add_ps(c00, _mm_mul_ps(a0, b0)); c01 = _mm_add_ps(c01, _mm_mul_ps(a0, b1));
+        c10 = _mm_add_ps(c10, _mm_mul_ps(a1, b0)); c11 = _mm_add_ps(c11, _mm_mul_ps(a1, b1));
+        c20 = _mm_add_ps(c20, _mm_mul_ps(a2, b0)); c21 = _mm_add_ps(c21, _mm_mul_ps(a2, b1));
+        c30 = _mm_add_ps(c30, _mm_mul_ps(a3, b0)); c31 = _mm_add_ps(c31, _mm_mul_ps(a3, b1));
+        a += 4;
+        b += 8;
+    }
+    _mm_storeu_ps(c,           _mm_add_ps(_mm_loadu_ps(c),           c00));
+    _mm_storeu_ps(c + 4,       _mm_add_ps(_mm_loadu_ps(c + 4),       c01));
+    _mm_storeu_ps(c + ldc,     _mm_add_ps(_mm_loadu_ps(c + ldc),     c10));
+    _mm_storeu_ps(c + ldc+4,   _mm_add_ps(_mm_loadu_ps(c + ldc+4),   c11));
+    _mm_storeu_ps(c + 2*ldc,   _mm_add_ps(_mm_loadu_ps(c + 2*ldc),   c20));
+    _mm_storeu_ps(c + 2*ldc+4, _mm_add_ps(_mm_loadu_ps(c + 2*ldc+4), c21));
+    _mm_storeu_ps(c + 3*ldc,   _mm_add_ps(_mm_loadu_ps(c + 3*ldc),   c30));
+    _mm_storeu_ps(c + 3*ldc+4, _mm_add_ps(_mm_loadu_ps(c + 3*ldc+4), c31));
+}
+
+__attribute__((target("avx2,fma")))
+static void gemm_kernel_avx2_6x16(int k, const float *a, const float *b, float *c, int ldc)
+{
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    int p;
+    for(p = 0; p < k; ++p){
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b + 8);
+        __m256 ai;
+        ai = _mm256_broadcast_ss(a + 0); c00 = _mm256_fmadd_ps(ai, b0, c00); c01 = _mm256_fmadd_ps(ai, b1, c01);
+        ai = _mm256_broadcast_ss(a + 1); c10 = _mm256_fmadd_ps(ai, b0, c10); c11 = _mm256_fmadd_ps(ai, b1, c11);
+        ai = _mm256_broadcast_ss(a + 2); c20 = _mm256_fmadd_ps(ai, b0, c20); c21 = _mm256_fmadd_ps(ai, b1, c21);
+        ai = _mm256_broadcast_ss(a + 3); c30 = _mm256_fmadd_ps(ai, b0, c30); c31 = _mm256_fmadd_ps(ai, b1, c31);
+        ai = _mm256_broadcast_ss(a + 4); c40 = _mm256_fmadd_ps(ai, b0, c40); c41 = _mm256_fmadd_ps(ai, b1, c41);
+        ai = _mm256_broadcast_ss(a + 5); c50 = _mm256_fmadd_ps(ai, b0, c50); c51 = _mm256_fmadd_ps(ai, b1, c51);
+        a += 6;
+        b += 16;
+    }
+    _mm256_storeu_ps(c,           _mm256_add_ps(_mm256_loadu_ps(c),           c00));
+    _mm256_storeu_ps(c + 8,       _mm256_add_ps(_mm256_loadu_ps(c + 8),       c01));
+    _mm256_storeu_ps(c + ldc,     _mm256_add_ps(_mm256_loadu_ps(c + ldc),     c10));
+    _mm256_storeu_ps(c + ldc+8,   _mm256_add_ps(_mm256_loadu_ps(c + ldc+8),   c11));
+    _mm256_storeu_ps(c + 2*ldc,   _mm256_add_ps(_mm256_loadu_ps(c + 2*ldc),   c20));
+    _mm256_storeu_ps(c + 2*ldc+8, _mm256_add_ps(_mm256_loadu_ps(c + 2*ldc+8), c21));
+    _mm256_storeu_ps(c + 3*ldc,   _mm256_add_ps(_mm256_loadu_ps(c + 3*ldc),   c30));
+    _mm256_storeu_ps(c + 3*ldc+8, _mm256_add_ps(_mm256_loadu_ps(c + 3*ldc+8), c31));
+    _mm256_storeu_ps(c + 4*ldc,   _mm256_add_ps(_mm256_loadu_ps(c + 4*ldc),   c40));
+    _mm256_storeu_ps(c + 4*ldc+8, _mm256_add_ps(_mm256_loadu_ps(c + 4*ldc+8), c41));
+    _mm256_storeu_ps(c + 5*ldc,   _mm256_add_ps(_mm256_loadu_ps(c + 5*ldc),   c50));
+    _mm256_storeu_ps(c + 5*ldc+8, _mm256_add_ps(_mm256_loadu_ps(c + 5*ldc+8), c51));
+}
+#endif
+
+static const gemm_kernel gemm_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx2", 6, 16, 72, 256, 4080, gemm_kernel_avx2_6x16},
+    {"sse",  4,  8, 64, 256, 4096, gemm_kernel_sse_4x8},
+#endif
+    {"generic", 4, 8, 64, 256, 4096, gemm_kernel_generic_4x8},
+};
+
+static int gemm_kernel_supported(const gemm_kernel *k)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(strcmp(k->name, "avx2") == 0) return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if(strcmp(k->name, "sse") == 0) return __builtin_cpu_supports("sse2");
+#endif
+    return 1;
+}
+
+static const gemm_kernel *select_gemm_kernel()
+{
+    int n = sizeof(gemm_kernels)/sizeof(gemm_kernels[0]);
+    int i;
+    char *name = getenv("DARKNET_GEMM");
+    if(name){
+        for(i = 0; i < n; ++i){
+            if(strcmp(gemm_kernels[i].name, name) != 0) continue;
+            if(gemm_kernel_supported(gemm_kernels + i)) return gemm_kernels + i;
+            fprintf(stderr, "This CPU can't run GEMM kernel %s, picking automatically\n", name);
+            break;
+        }
+        if(i == n) fprintf(stderr, "Unknown GEMM kernel %s, picking automatically\n", name);
+    }
+    for(i = 0; i < n - 1; ++i){
+        if(gemm_kernel_supported(gemm_kernels + i)) return gemm_kernels + i;
+    }
+    return gemm_kernels + n - 1;
+}
+
+const gemm_kernel *get_gemm_kernel()
+{
+    static const gemm_kernel *kernel = select_gemm_kernel();
+    return kernel;
+}
+
+void gemm_apply_epilogue(const gemm_epilogue *ep, int row, int rows, int col, int cols, float *C, int ldc)
+{
+    int i, j;
+    for(i = 0; i < rows; ++i){
+        int r = row + i;
+        float *c = C + i*ldc;
+        if(ep->scales){
+            float scale = ep->scales[r];
+            for(j = 0; j < cols; ++j) c[j] *= scale;
+        }
+        if(ep->biases){
+            float bias = ep->biases[r];
+            for(j = 0; j < cols; ++j) c[j] += bias;
+        }
+        activate_span(c, cols, ep->activation);
+        if(ep->add){
+            float *add = ep->add + r*ldc + col;
+            for(j = 0; j < cols; ++j) c[j] = ep->alpha*c[j] + ep->beta*add[j];
+            activate_span(c, cols, ep->add_activation);
+        }
+    }
+}
+
+// Stores one micro-tile into a batched C, whose columns run through each
+// image in turn, splitting it where it crosses into the next image
+static void gemm_batch_tile(const gemm_kernel *kern, int kc, const float *a, const float *b, int rows, int cols,
+        const gemm_epilogue *ep, int row, int col, float *C, int ldc, const gemm_c_batch *cb)
+{
+    int mr = kern->mr, nr = kern->nr;
+    int img = col/cb->n, off = col%cb->n;
+    int t, u, v;
+    float tile[16*16];
+    if(rows == mr && cols == nr && off + nr <= cb->n){
+        float *c = C + img*cb->stride + row*ldc + off;
+        kern->kernel(kc, a, b, c, ldc);
+        if(ep){
+            gemm_epilogue e = *ep;
+            if(e.add) e.add += img*cb->stride;
+            gemm_apply_epilogue(&e, row, rows, off, cols, c, ldc);
+        }
+        return;
+    }
+    memset(tile, 0, mr*nr*sizeof(float));
+    kern->kernel(kc, a, b, tile, nr);
+    for(u = 0; u < cols; u += v, ++img, off = 0){
+        float *c = C + img*cb->stride + row*ldc + off;
+        v = (cols - u < cb->n - off) ? cols - u : cb->n - off;
+        for(t = 0; t < rows; ++t){
+            int w;
+            for(w = 0; w < v; ++w) c[t*ldc + w] += tile[t*nr + u + w];
+        }
+        if(ep){
+            gemm_epilogue e = *ep;
+            if(e.add) e.add += img*cb->stride;
+            gemm_apply_epilogue(&e, row, rows, off, v, c, ldc);
+        }
+    }
+}
+
+// ep is only passed on the last KC slice, once each C tile holds its final sum.
+// With cb, C is the whole batched matrix rather than this block of it.
+static void gemm_macro_kernel(const gemm_kernel *kern, int mc, int nc, int kc, const float *pa, const float *pb,
+        const gemm_epilogue *ep, int ic, int jc, float *C, int ldc, const gemm_c_batch *cb)
+{
+    int mr = kern->mr, nr = kern->nr;
+    int i, j, t;
+    float tile[16*16];
+    for(j = 0; j < nc; j += nr){
+        int cols = (nc - j < nr) ? nc - j : nr;
+        for(i = 0; i < mc; i += mr){
+            int rows = (mc - i < mr) ? mc - i : mr;
+            const float *a = pa + i*kc;
+            const float *b = pb + j*kc;
+            if(cb){
+                gemm_batch_tile(kern, kc, a, b, rows, cols, ep, ic + i, jc + j, C, ldc, cb);
+                continue;
+            }
+            if(rows == mr && cols == nr){
+                kern->kernel(kc, a, b, C + i*ldc + j, ldc);
+            } else {
+                memset(tile, 0, mr*nr*sizeof(float));
+                kern->kernel(kc, a, b, tile, nr);
+                for(t = 0; t < rows; ++t){
+                    int u;
+                    for(u = 0; u < cols; ++u) C[(i + t)*ldc + j + u] += tile[t*nr + u];
+                }
+            }
+            if(ep) gemm_apply_epilogue(ep, ic + i, rows, jc + j, cols, C + i*ldc + j, ldc);
+        }
+    }
+}
+
+void gemm_pack_b_source(void *b, int k, int kc, int j, int nc, int nr, float *buf)
+{
+    gemm_b_matrix *m = (gemm_b_matrix *)b;
+    gemm_pack_b(m->TB, kc, nc, nr, m->TB ? m->B + j*m->ldb + k : m->B + k*m->ldb + j, m->ldb, buf);
+}
+
+/*
+ * Pre-packed operands hold every block the driver would pack, in the order
+ * it visits them: A as KC slices of MR panels over all of M, B as NC blocks
+ * of KC slices of NR panels. Block (pc, ic) of A starts at pc*Mp + ic*kcb and
+ * block (jc, pc) of B at jc*K + pc*ncp, Mp and ncp being rounded up to MR/NR.
+ */
+
+static int gemm_round_up(int x, int r)
+{
+    return (x + r - 1)/r*r;
+}
+
+size_t gemm_packed_a_size(int M, int K)
+{
+    return (size_t)gemm_round_up(M, get_gemm_kernel()->mr)*K;
+}
+
+size_t gemm_packed_b_size(int K, int N)
+{
+    return (size_t)K*gemm_round_up(N, get_gemm_kernel()->nr);
+}
+
+float *gemm_packed_alloc(size_t n)
+{
+    float *p = 0;
+    if(posix_memalign((void **)&p, GEMM_ALIGN, n*sizeof(float))) malloc_error();
+    return p;
+}
+
+void gemm_pack_a_matrix(int M, int K, float *A, int lda, float *packed)
+{
+    const gemm_kernel *kern = get_gemm_kernel();
+    int Mp = gemm_round_up(M, kern->mr);
+    int ic, pc;
+    for(pc = 0; pc < K; pc += kern->kc){
+        int kcb = (K - pc < kern->kc) ? K - pc : kern->kc;
+        for(ic = 0; ic < M; ic += kern->mc){
+            int mcb = (M - ic < kern->mc) ? M - ic : kern->mc;
+            gemm_pack_a(0, mcb, kcb, kern->mr, 1, A + ic*lda + pc, lda, packed + (size_t)pc*Mp + (size_t)ic*kcb);
+        }
+    }
+}
+
+void gemm_pack_b_matrix(int TB, int K, int N, float *B, int ldb, float *packed)
+{
+    const gemm_kernel *kern = get_gemm_kernel();
+    int jc, pc;
+    for(jc = 0; jc < N; jc += kern->nc){
+        int ncb = (N - jc < kern->nc) ? N - jc : kern->nc;
+        int ncp = gemm_round_up(ncb, kern->nr);
+        for(pc = 0; pc < K; pc += kern->kc){
+            int kcb = (K - pc < kern->kc) ? K - pc : kern->kc;
+            gemm_pack_b(TB, kcb, ncb, kern->nr, TB ? B + jc*ldb + pc : B + pc*ldb + jc, ldb,
+                    packed + (size_t)jc*K + (size_t)pc*ncp);
+        }
+    }
+}
+
+typedef struct {
+    const gemm_kernel *kern;
+    int TA, M, N, K;
+    float ALPHA;
+    float *A;
+    int lda;
+    float *packed_a;
+    const uint16_t *half_a;
+    WEIGHT_FORMAT format;
+    gemm_pack_b_fn pack_b;
+    void *b;
+    const gemm_epilogue *ep;
+    float *C;
+    int ldc;
+    const gemm_c_batch *cb;
+    int jc, ncb, pc, kcb;
+    int split_n, split_w;
+    float *pb;
+} gemm_block_job;
+
+static void gemm_pack_b_panels(void *ptr, int begin, int end)
+{
+    gemm_block_job *g = (gemm_block_job *)ptr;
+    int nr = g->kern->nr;
+    int j0 = begin*g->split_w;
+    int j1 = (end*g->split_w < g->ncb) ? end*g->split_w : g->ncb;
+    g->pack_b(g->b, g->pc, g->kcb, g->jc + j0, j1 - j0, nr, g->pb + (size_t)j0*g->kcb);
+}
+
+// One tile is an MC block of rows against a strip of NR aligned columns,
+// packing its own copy of the A block
+static void gemm_block_tiles(void *ptr, int begin, int end)
+{
+    static thread_local float *pack_a = 0;
+    static thread_local size_t pack_a_size = 0;
+    gemm_block_job *g = (gemm_block_job *)ptr;
+    const gemm_kernel *kern = g->kern;
+    int mr = kern->mr, mc = kern->mc, kc = kern->kc;
+    int pc = g->pc, kcb = g->kcb;
+    int t;
+    for(t = begin; t < end; ++t){
+        int ic = (t/g->split_n)*mc;
+        int j0 = (t%g->split_n)*g->split_w;
+        int mcb = (g->M - ic < mc) ? g->M - ic : mc;
+        int w = (g->ncb - j0 < g->split_w) ? g->ncb - j0 : g->split_w;
+        float *pa;
+        if(w <= 0) continue;
+        if(g->packed_a){
+            pa = g->packed_a + (size_t)pc*gemm_round_up(g->M, mr) + (size_t)ic*kcb;
+        } else if(g->half_a){
+            pa = gemm_buffer(&pack_a, &pack_a_size, (size_t)kc*gemm_round_up(mc, mr));
+            gemm_pack_a_half(mcb, kcb, mr, g->format, g->half_a + (size_t)ic*g->lda + pc, g->lda, pa);
+        } else {
+            pa = gemm_buffer(&pack_a, &pack_a_size, (size_t)kc*gemm_round_up(mc, mr));
+            gemm_pack_a(g->TA, mcb, kcb, mr, g->ALPHA, g->TA ? g->A + pc*g->lda + ic : g->A + ic*g->lda + pc, g->lda, pa);
+        }
+        gemm_macro_kernel(kern, mcb, w, kcb, pa, g->pb + (size_t)j0*kcb, (pc + kcb == g->K) ? g->ep : 0,
+                ic, g->jc + j0, g->cb ? g->C : g->C + ic*g->ldc + g->jc + j0, g->ldc, g->cb);
+    }
+}
+
+/*
+ * Each (NC, KC) block of B is packed once, split across the pool in NR
+ * aligned strips, then C is tiled over MC row blocks and, when there are too
+ * few of those to keep every thread busy, NR aligned column strips. Every C
+ * element still runs through the same micro-kernel call whatever the split,
+ * so results do not depend on the thread count.
+ */
+static void gemm_blocked_packed(const gemm_kernel *kern, int TA, int M, int N, int K, float ALPHA,
+        float *A, int lda, float *packed_a, const uint16_t *half_a, WEIGHT_FORMAT format,
+        gemm_pack_b_fn pack_b, void *b, float *packed_b,
+        const gemm_epilogue *ep,
+        float *C, int ldc, const gemm_c_batch *cb)
+{
+    static thread_local float *pack_b_buf = 0;
+    static thread_local size_t pack_b_size = 0;
+    int nr = kern->nr;
+    int mc = kern->mc, kc = kern->kc, nc = kern->nc;
+    int threads = parallel_threads();
+    int blocks = (M + mc - 1)/mc;
+    int jc, pc;
+    gemm_block_job g = {kern, TA, M, N, K, ALPHA, A, lda, packed_a, half_a, format, pack_b, b, ep, C, ldc, cb};
+
+    for(jc = 0; jc < N; jc += nc){
+        int ncb = (N - jc < nc) ? N - jc : nc;
+        int panels = (ncb + nr - 1)/nr;
+        g.jc = jc;
+        g.ncb = ncb;
+        for(pc = 0; pc < K; pc += kc){
+            int kcb = (K - pc < kc) ? K - pc : kc;
+            g.pc = pc;
+            g.kcb = kcb;
+            if(packed_b){
+                g.pb = packed_b + (size_t)jc*K + (size_t)pc*gemm_round_up(ncb, nr);
+            } else {
+                int strips = (threads < panels) ? threads : panels;
+                g.pb = gemm_buffer(&pack_b_buf, &pack_b_size, (size_t)kc*gemm_round_up(nc, nr));
+                g.split_w = (panels + strips - 1)/strips*nr;
+                parallel_for((ncb + g.split_w - 1)/g.split_w, 1, gemm_pack_b_panels, &g);
+            }
+
+            g.split_n = 1;
+            if(blocks < 2*threads){
+                g.split_n = (2*threads + blocks - 1)/blocks;
+                if(g.split_n > panels) g.split_n = panels;
+            }
+            g.split_w = (panels + g.split_n - 1)/g.split_n*nr;
+            g.split_n = (ncb + g.split_w - 1)/g.split_w;
+            parallel_for(blocks*g.split_n, 1, gemm_block_tiles, &g);
+        }
+    }
+}
+
+void gemm_blocked(const gemm_kernel *kern, int TA, int TB, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        float *B, int ldb,
+        float *C, int ldc)
+{
+    gemm_b_matrix b = {TB, B, ldb};
+    gemm_blocked_packed(kern, TA, M, N, K, ALPHA, A, lda, 0, 0, WEIGHTS_FP32, gemm_pack_b_source, &b, 0, 0, C, ldc, 0);
+}
+
+void gemm_cpu_implicit(int TA, int M, int N, int K, float ALPHA,
+        float *A, int lda, float *packed_a,
+        gemm_pack_b_fn pack_b, void *b,
+        const gemm_epilogue *ep,
+        float *C, int ldc)
+{
+    gemm_blocked_packed(get_gemm_kernel(), TA, M, N, K, ALPHA, A, lda, packed_a, 0, WEIGHTS_FP32, pack_b, b, 0, ep, C, ldc, 0);
+}
+
+void gemm_cpu_packed_a(int M, int N, int K, float *packed_a,
+        int TB, float *B, int ldb,
+        const gemm_epilogue *ep,
+        float *C, int ldc)
+{
+    gemm_b_matrix b = {TB, B, ldb};
+    gemm_blocked_packed(get_gemm_kernel(), 0, M, N, K, 1, 0, 0, packed_a, 0, WEIGHTS_FP32, gemm_pack_b_source, &b, 0, ep, C, ldc, 0);
+}
+
+void gemm_cpu_packed_b(int TA, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        float *packed_b,
+        float *C, int ldc)
+{
+    gemm_blocked_packed(get_gemm_kernel(), TA, M, N, K, ALPHA, A, lda, 0, 0, WEIGHTS_FP32, 0, 0, packed_b, 0, C, ldc, 0);
+}
+
+void gemm_cpu_half(int M, int N, int K, const uint16_t *A, int lda, WEIGHT_FORMAT format,
+        gemm_pack_b_fn pack_b, void *b,
+        const gemm_epilogue *ep,
+        float *C, int ldc)
+{
+    gemm_blocked_packed(get_gemm_kernel(), 0, M, N, K, 1, 0, lda, 0, A, format, pack_b, b, 0, ep, C, ldc, 0);
+}
+
+void gemm_cpu_batch(int M, int N, int K,
+        float *A, int lda, float *packed_a, const uint16_t *half_a, WEIGHT_FORMAT format,
+        gemm_pack_b_fn pack_b, void *b,
+        const gemm_epilogue *ep,
+        float *C, int ldc, const gemm_c_batch *cb)
+{
+    gemm_blocked_packed(get_gemm_kernel(), 0, M, N, K, 1, A, lda, packed_a, half_a, format, pack_b, b, 0, ep, C, ldc, cb);
+}
+
+#define GEMM_SIMPLE_TILE_M 32
+#define GEMM_SIMPLE_TILE_N 256
+
+typedef struct {
+    int TA, TB, M, N, K;
+    float ALPHA;
+    float *A;
+    int lda;
+    float *B;
+    int ldb;
+    float *C;
+    int ldc;
+} gemm_simple;
+
+// Tiles of the unblocked kernels over M and N, so a single row (a batch 1
+// connected layer) still spreads across threads
+static void gemm_simple_tiles(void *ptr, int begin, int end)
+{
+    gemm_simple *g = (gemm_simple *)ptr;
+    int tiles_n = (g->N + GEMM_SIMPLE_TILE_N - 1)/GEMM_SIMPLE_TILE_N;
+    int t;
+    for(t = begin; t < end; ++t){
+        int i = (t/tiles_n)*GEMM_SIMPLE_TILE_M;
+        int j = (t%tiles_n)*GEMM_SIMPLE_TILE_N;
+        int m = (g->M - i < GEMM_SIMPLE_TILE_M) ? g->M - i : GEMM_SIMPLE_TILE_M;
+        int n = (g->N - j < GEMM_SIMPLE_TILE_N) ? g->N - j : GEMM_SIMPLE_TILE_N;
+        float *a = g->TA ? g->A + i : g->A + i*g->lda;
+        float *b = g->TB ? g->B + j*g->ldb : g->B + j;
+        float *c = g->C + i*g->ldc + j;
+        if(!g->TA && !g->TB)
+            gemm_nn(m, n, g->K, g->ALPHA, a, g->lda, b, g->ldb, c, g->ldc);
+        else if(g->TA && !g->TB)
+            gemm_tn(m, n, g->K, g->ALPHA, a, g->lda, b, g->ldb, c, g->ldc);
+        else if(!g->TA && g->TB)
+            gemm_nt(m, n, g->K, g->ALPHA, a, g->lda, b, g->ldb, c, g->ldc);
+        else
+            gemm_tt(m, n, g->K, g->ALPHA, a, g->lda, b, g->ldb, c, g->ldc);
+    }
+}
+
 void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA, 
         float *A, int lda, 
         float *B, int ldb,
@@ -150,19 +720,21 @@ void gemm_cpu(int TA, int TB, int M, int N, int K, float ALPHA,
 {
     //printf("cpu: %d %d %d %d %d %f %d %d %f %d\n",TA, TB, M, N, K, ALPHA, lda, ldb, BETA, ldc);
     int i, j;
-    for(i = 0; i < M; ++i){
-        for(j = 0; j < N; ++j){
-            C[i*ldc + j] *= BETA;
+    if(BETA != 1){
+        for(i = 0; i < M; ++i){
+            for(j = 0; j < N; ++j){
+                C[i*ldc + j] *= BETA;
+            }
         }
     }
-    if(!TA && !TB)
-        gemm_nn(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
-    else if(TA && !TB)
-        gemm_tn(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
-    else if(!TA && TB)
-        gemm_nt(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
-    else
-        gemm_tt(M, N, K, ALPHA,A,lda, B, ldb,C,ldc);
+    if(M == 1 || N == 1 || (double)M*N*K < GEMM_BLOCKED_MIN_OPS){
+        gemm_simple args = {TA, TB, M, N, K, ALPHA, A, lda, B, ldb, C, ldc};
+        int tiles = ((M + GEMM_SIMPLE_TILE_M - 1)/GEMM_SIMPLE_TILE_M)*((N + GEMM_SIMPLE_TILE_N - 1)/GEMM_SIMPLE_TILE_N);
+        if((double)M*N*K < GEMM_BLOCKED_MIN_OPS) gemm_simple_tiles(&args, 0, tiles);
+        else parallel_for(tiles, 1, gemm_simple_tiles, &args);
+        return;
+    }
+    gemm_blocked(get_gemm_kernel(), TA, TB, M, N, K, ALPHA, A, lda, B, ldb, C, ldc);
 }
 
 #ifdef GPU
@@ -1,6 +1,94 @@
 #ifndef GEMM_H
 #define GEMM_H
 
+#include <stddef.h>
+#include "activations.h"
+
+#define GEMM_BLOCKED_MIN_OPS (32*32*32)
+
+typedef void (*gemm_kernel_fn)(int k, const float *a, const float *b, float *c, int ldc);
+
+// Packs rows [k, k+kc) and columns [j, j+nc) of an implicit B matrix into
+// nr-wide, zero padded column panels
+typedef void (*gemm_pack_b_fn)(void *b, int k, int kc, int j, int nc, int nr, float *buf);
+
+// Adapter for an explicit B matrix
+typedef struct {
+    int TB;
+    float *B;
+    int ldb;
+} gemm_b_matrix;
+
+void gemm_pack_b_source(void *b, int k, int kc, int j, int nc, int nr, float *buf);
+
+typedef struct {
+    const char *name;
+    int mr, nr;
+    int mc, kc, nc;
+    gemm_kernel_fn kernel;
+} gemm_kernel;
+
+// Applied to C once the product is complete:
+//   C = activation(C*scales[row] + biases[row])
+//   C = add_activation(alpha*C + beta*add)   if add, which has C's layout
+typedef struct {
+    float *scales;
+    float *biases;
+    ACTIVATION activation;
+    float *add;
+    float alpha, beta;
+    ACTIVATION add_activation;
+} gemm_epilogue;
+
+// C of a GEMM over a whole batch: N runs through every image's n columns in
+// turn and image i's rows start at C + i*stride
+typedef struct {
+    int n;
+    size_t stride;
+} gemm_c_batch;
+
+void gemm_apply_epilogue(const gemm_epilogue *ep, int row, int rows, int col, int cols, float *C, int ldc);
+
+const gemm_kernel *get_gemm_kernel();
+void gemm_blocked(const gemm_kernel *kern, int TA, int TB, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        float *B, int ldb,
+        float *C, int ldc);
+void gemm_cpu_implicit(int TA, int M, int N, int K, float ALPHA,
+        float *A, int lda, float *packed_a,
+        gemm_pack_b_fn pack_b, void *b,
+        const gemm_epilogue *ep,
+        float *C, int ldc);
+
+// Operands packed once into the blocked driver's panel layout; packed A has
+// ALPHA == 1 folded in. Layouts are tied to the kernel get_gemm_kernel picks.
+size_t gemm_packed_a_size(int M, int K);
+size_t gemm_packed_b_size(int K, int N);
+float *gemm_packed_alloc(size_t n);
+void gemm_pack_a_matrix(int M, int K, float *A, int lda, float *packed);
+void gemm_pack_b_matrix(int TB, int K, int N, float *B, int ldb, float *packed);
+void gemm_cpu_packed_a(int M, int N, int K, float *packed_a,
+        int TB, float *B, int ldb,
+        const gemm_epilogue *ep,
+        float *C, int ldc);
+void gemm_cpu_packed_b(int TA, int M, int N, int K, float ALPHA,
+        float *A, int lda,
+        float *packed_b,
+        float *C, int ldc);
+
+// A stored as fp16 or bf16, widened to fp32 as each block is packed
+void gemm_cpu_half(int M, int N, int K, const uint16_t *A, int lda, WEIGHT_FORMAT format,
+        gemm_pack_b_fn pack_b, void *b,
+        const gemm_epilogue *ep,
+        float *C, int ldc);
+
+// One GEMM for the whole batch, A given as fp32, pre-packed or half
+void gemm_cpu_batch(int M, int N, int K,
+        float *A, int lda, float *packed_a, const uint16_t *half_a, WEIGHT_FORMAT format,
+        gemm_pack_b_fn pack_b, void *b,
+        const gemm_epilogue *ep,
+        float *C, int ldc, const gemm_c_batch *cb);
+
 void gemm_bin(int M, int N, int K, float ALPHA, 
         char  *A, int lda, 
         float *B, int ldb,
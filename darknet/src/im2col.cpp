@@ -1,5 +1,26 @@
 #include "im2col.h"
+#include "thread_pool.h"
 #include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static int im2col_copy_stride2_avx2(const float *src, int n, float *dst)
+{
+    int u;
+    // The last load reaches one float past the final pixel, so stop short
+    for(u = 0; u + 9 <= n; u += 8){
+        __m256 lo = _mm256_loadu_ps(src + 2*u);
+        __m256 hi = _mm256_loadu_ps(src + 2*u + 8);
+        __m256 even = _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+        even = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(even), _MM_SHUFFLE(3, 1, 2, 0)));
+        _mm256_storeu_ps(dst + u, even);
+    }
+    return u;
+}
+#endif
 float im2col_get_pixel(float *im, int height, int width, int channels,
                         int row, int col, int channel, int pad)
 {
@@ -13,7 +34,7 @@ float im2col_get_pixel(float *im, int height, int width, int channels,
 
 //From Berkeley Vision's Caffe!
 //https://github.com/BVLC/caffe/blob/master/LICENSE
-void im2col_cpu(float* data_im,
+static void im2col_generic(float* data_im,
      int channels,  int height,  int width,
      int ksize,  int stride, int pad, float* data_col) 
 {
@@ -38,3 +59,178 @@ void im2col_cpu(float* data_im,
     }
 }
 
+// Copies n pixels stride apart from src; the caller guarantees they are all
+// inside the row
+static void im2col_copy(const float *src, int stride, int n, float *dst)
+{
+    int u = 0;
+    if(stride == 1){
+        memcpy(dst, src, n*sizeof(float));
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    static int avx2 = __builtin_cpu_supports("avx2");
+    if(stride == 2 && avx2) u = im2col_copy_stride2_avx2(src, n, dst);
+#endif
+    for(; u < n; ++u) dst[u] = src[u*stride];
+}
+
+/*
+ * Fixed kernel size and stride let every tap's offsets fold into constants.
+ * Each output row splits into a left border, an interior whose taps are all
+ * inside the image and copy without checks, and a right border.
+ */
+template <int KSIZE, int STRIDE>
+static void im2col_fixed(float *data_im, int channels, int height, int width, int pad, float *data_col)
+{
+    int height_col = (height + 2*pad - KSIZE) / STRIDE + 1;
+    int width_col = (width + 2*pad - KSIZE) / STRIDE + 1;
+    int w0 = (pad + STRIDE - 1) / STRIDE;
+    int w1 = (width - KSIZE + pad) / STRIDE + 1;
+    if(w0 > width_col) w0 = width_col;
+    if(w1 < w0) w1 = w0;
+    if(w1 > width_col) w1 = width_col;
+    int c, h, w, ky, kx;
+    for (c = 0; c < channels; ++c) {
+        float *im = data_im + c*height*width;
+        for (ky = 0; ky < KSIZE; ++ky) {
+            for (kx = 0; kx < KSIZE; ++kx) {
+                float *col = data_col + ((c*KSIZE + ky)*KSIZE + kx)*height_col*width_col;
+                for (h = 0; h < height_col; ++h) {
+                    int row = h*STRIDE + ky - pad;
+                    float *dst = col + h*width_col;
+                    if (row < 0 || row >= height) {
+                        memset(dst, 0, width_col*sizeof(float));
+                        continue;
+                    }
+                    float *src = im + row*width + kx - pad;
+                    for (w = 0; w < w0; ++w) {
+                        int x = w*STRIDE + kx - pad;
+                        dst[w] = (x >= 0 && x < width) ? src[w*STRIDE] : 0;
+                    }
+                    im2col_copy(src + w0*STRIDE, STRIDE, w1 - w0, dst + w0);
+                    for (w = w1; w < width_col; ++w) {
+                        int x = w*STRIDE + kx - pad;
+                        dst[w] = (x >= 0 && x < width) ? src[w*STRIDE] : 0;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void im2col_dispatch(float* data_im,
+     int channels,  int height,  int width,
+     int ksize,  int stride, int pad, float* data_col)
+{
+    if (ksize == 3 && stride == 1) im2col_fixed<3, 1>(data_im, channels, height, width, pad, data_col);
+    else if (ksize == 3 && stride == 2) im2col_fixed<3, 2>(data_im, channels, height, width, pad, data_col);
+    else if (ksize == 1 && stride == 1) im2col_fixed<1, 1>(data_im, channels, height, width, pad, data_col);
+    else if (ksize == 1 && stride == 2) im2col_fixed<1, 2>(data_im, channels, height, width, pad, data_col);
+    else if (ksize == 5 && stride == 1) im2col_fixed<5, 1>(data_im, channels, height, width, pad, data_col);
+    else if (ksize == 5 && stride == 2) im2col_fixed<5, 2>(data_im, channels, height, width, pad, data_col);
+    else if (ksize == 7 && stride == 2) im2col_fixed<7, 2>(data_im, channels, height, width, pad, data_col);
+    else im2col_generic(data_im, channels, height, width, ksize, stride, pad, data_col);
+}
+
+typedef struct {
+    float *data_im;
+    int height, width, ksize, stride, pad;
+    float *data_col;
+} im2col_job;
+
+// Channels unroll into disjoint runs of rows, so they split freely
+static void im2col_channels(void *ptr, int begin, int end)
+{
+    im2col_job *j = (im2col_job *)ptr;
+    int height_col = (j->height + 2*j->pad - j->ksize) / j->stride + 1;
+    int width_col = (j->width + 2*j->pad - j->ksize) / j->stride + 1;
+    im2col_dispatch(j->data_im + (size_t)begin*j->height*j->width, end - begin, j->height, j->width,
+            j->ksize, j->stride, j->pad, j->data_col + (size_t)begin*j->ksize*j->ksize*height_col*width_col);
+}
+
+void im2col_cpu(float* data_im,
+     int channels,  int height,  int width,
+     int ksize,  int stride, int pad, float* data_col)
+{
+    im2col_job j = {data_im, height, width, ksize, stride, pad, data_col};
+    parallel_for(channels, 4, im2col_channels, &j);
+}
+
+static void im2col_segment(float *chan, int height, int width, int width_col,
+        int h_offset, int w_offset, int stride, int pad, int col, int n, float *dst)
+{
+    int h = col / width_col;
+    int w = col % width_col;
+    int t = 0;
+    while(t < n){
+        int run = width_col - w;
+        if(run > n - t) run = n - t;
+        int im_row = h_offset + h*stride - pad;
+        int im_col = w_offset + w*stride - pad;
+        int u;
+        if(im_row < 0 || im_row >= height){
+            for(u = 0; u < run; ++u) dst[t + u] = 0;
+        } else if(im_col >= 0 && im_col + (run - 1)*stride < width){
+            im2col_copy(chan + im_row*width + im_col, stride, run, dst + t);
+        } else {
+            float *src = chan + im_row*width;
+            for(u = 0; u < run; ++u){
+                int x = im_col + u*stride;
+                dst[t + u] = (x >= 0 && x < width) ? src[x] : 0;
+            }
+        }
+        t += run;
+        w = 0;
+        ++h;
+    }
+}
+
+// Same matrix as im2col_cpu, but only rows [row, row+rows) and columns
+// [col, col+cols), written as nr-wide zero padded panels for the blocked GEMM
+void im2col_panels_cpu(float* data_im,
+     int channels,  int height,  int width,
+     int ksize,  int stride, int pad,
+     int row, int rows, int col, int cols, int nr, float* panels)
+{
+    im2col_panels_batch_cpu(data_im, 0, channels, height, width, ksize, stride, pad, row, rows, col, cols, nr, panels);
+}
+
+// As im2col_panels_cpu over a batch whose images are im_stride floats apart,
+// the columns of each image following the previous image's
+void im2col_panels_batch_cpu(float* data_im, size_t im_stride,
+     int channels,  int height,  int width,
+     int ksize,  int stride, int pad,
+     int row, int rows, int col, int cols, int nr, float* panels)
+{
+    int height_col = (height + 2*pad - ksize) / stride + 1;
+    int width_col = (width + 2*pad - ksize) / stride + 1;
+    int pixels = height_col*width_col;
+    int direct = ksize == 1 && stride == 1 && pad == 0;
+    int c, p, t;
+    for (c = 0; c < rows; ++c) {
+        int w_offset = (row + c) % ksize;
+        int h_offset = ((row + c) / ksize) % ksize;
+        int c_im = (row + c) / ksize / ksize;
+        int img = col / pixels;
+        int off = col % pixels;
+        for (p = 0; p < cols; p += nr) {
+            int n = (cols - p < nr) ? cols - p : nr;
+            float *dst = panels + p*rows + c*nr;
+            for (t = 0; t < n; ) {
+                int run = (n - t < pixels - off) ? n - t : pixels - off;
+                float *chan = data_im + img*im_stride + c_im*height*width;
+                // 1x1 layers read their input as is, a whole run at a time
+                if (direct) memcpy(dst + t, chan + off, run*sizeof(float));
+                else im2col_segment(chan, height, width, width_col, h_offset, w_offset, stride, pad, off, run, dst + t);
+                t += run;
+                off += run;
+                if (off == pixels) {
+                    off = 0;
+                    ++img;
+                }
+            }
+            if (n < nr) memset(dst + n, 0, (nr - n)*sizeof(float));
+        }
+    }
+}
@@ -1,9 +1,19 @@
 #ifndef IM2COL_H
 #define IM2COL_H
 
+#include <stddef.h>
+
 void im2col_cpu(float* data_im,
         int channels, int height, int width,
         int ksize, int stride, int pad, float* data_col);
+void im2col_panels_cpu(float* data_im,
+        int channels, int height, int width,
+        int ksize, int stride, int pad,
+        int row, int rows, int col, int cols, int nr, float* panels);
+void im2col_panels_batch_cpu(float* data_im, size_t im_stride,
+        int channels, int height, int width,
+        int ksize, int stride, int pad,
+        int row, int rows, int col, int cols, int nr, float* panels);
 
 #ifdef GPU
 
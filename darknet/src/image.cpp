@@ -1,6 +1,7 @@
 #include "image.h"
 #include "utils.h"
 #include "blas.h"
+#include "thread_pool.h"
 #include "cuda.h"
 #include <stdio.h>
 #include <math.h>
@@ -1202,14 +1203,20 @@ void saturate_exposure_image(image im, float sat, float exposure)
     constrain_image(im);
 }
 
-image resize_image(image im, int w, int h)
+typedef struct {
+    image im, part, resized;
+} resize_job;
+
+// Both passes only touch their own channel, so channels resize in parallel
+static void resize_channels(void *ptr, int begin, int end)
 {
-    image resized = make_image(w, h, im.c);   
-    image part = make_image(w, im.h, im.c);
+    resize_job *j = (resize_job *)ptr;
+    image im = j->im, part = j->part, resized = j->resized;
+    int w = resized.w, h = resized.h;
     int r, c, k;
     float w_scale = (float)(im.w - 1) / (w - 1);
     float h_scale = (float)(im.h - 1) / (h - 1);
-    for(k = 0; k < im.c; ++k){
+    for(k = begin; k < end; ++k){
         for(r = 0; r < im.h; ++r){
             for(c = 0; c < w; ++c){
                 float val = 0;
@@ -1224,8 +1231,6 @@ image resize_image(image im, int w, int h)
                 set_pixel(part, c, r, k, val);
             }
         }
-    }
-    for(k = 0; k < im.c; ++k){
         for(r = 0; r < h; ++r){
             float sy = r*h_scale;
             int iy = (int) sy;
@@ -1241,7 +1246,14 @@ image resize_image(image im, int w, int h)
             }
         }
     }
+}
 
+image resize_image(image im, int w, int h)
+{
+    image resized = make_image(w, h, im.c);   
+    image part = make_image(w, im.h, im.c);
+    resize_job j = {im, part, resized};
+    parallel_for(im.c, 1, resize_channels, &j);
     free_image(part);
     return resized;
 }
@@ -27,14 +27,23 @@ void free_layer(layer l)
     if(l.concat)             free(l.concat);
     if(l.concat_delta)       free(l.concat_delta);
     if(l.binary_weights)     free(l.binary_weights);
-    if(l.biases)             free(l.biases);
+    if(l.winograd_weights)   free(l.winograd_weights);
+    if(l.packed_weights)     free(l.packed_weights);
+    if(l.fused_scales)       free(l.fused_scales);
+    if(l.fused_biases)       free(l.fused_biases);
+    if(l.int8_weights)       free(l.int8_weights);
+    if(l.int8_scales)        free(l.int8_scales);
+    if(l.half_weights)       free(l.half_weights);
+    if(l.xnor_weights)       free(l.xnor_weights);
+    if(l.xnor_scales)        free(l.xnor_scales);
+    if(l.biases && !l.weights_mapped) free(l.biases);
     if(l.bias_updates)       free(l.bias_updates);
-    if(l.scales)             free(l.scales);
+    if(l.scales && !l.weights_mapped) free(l.scales);
     if(l.scale_updates)      free(l.scale_updates);
-    if(l.weights)            free(l.weights);
+    if(l.weights && !l.weights_mapped) free(l.weights);
     if(l.weight_updates)     free(l.weight_updates);
     if(l.delta)              free(l.delta);
-    if(l.output)             free(l.output);
+    if(l.output && !l.output_alias) free(l.output);
     if(l.squared)            free(l.squared);
     if(l.norms)              free(l.norms);
     if(l.spatial_mean)       free(l.spatial_mean);
@@ -42,8 +51,8 @@ void free_layer(layer l)
     if(l.variance)           free(l.variance);
     if(l.mean_delta)         free(l.mean_delta);
     if(l.variance_delta)     free(l.variance_delta);
-    if(l.rolling_mean)       free(l.rolling_mean);
-    if(l.rolling_variance)   free(l.rolling_variance);
+    if(l.rolling_mean && !l.weights_mapped) free(l.rolling_mean);
+    if(l.rolling_variance && !l.weights_mapped) free(l.rolling_variance);
     if(l.x)                  free(l.x);
     if(l.x_norm)             free(l.x_norm);
     if(l.m)                  free(l.m);
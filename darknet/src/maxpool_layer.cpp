@@ -1,5 +1,6 @@
 #include "maxpool_layer.h"
 #include "cuda.h"
+#include "thread_pool.h"
 #include <stdio.h>
 
 image get_maxpool_image(maxpool_layer l)
@@ -18,7 +19,7 @@ image get_maxpool_delta(maxpool_layer l)
     return float_to_image(w,h,c,l.delta);
 }
 
-maxpool_layer make_maxpool_layer(int batch, int h, int w, int c, int size, int stride, int padding)
+maxpool_layer make_maxpool_layer(int batch, int h, int w, int c, int size, int stride, int padding, int train)
 {
     maxpool_layer l = {0};
     l.type = MAXPOOL;
@@ -35,9 +36,11 @@ maxpool_layer make_maxpool_layer(int batch, int h, int w, int c, int size, int s
     l.size = size;
     l.stride = stride;
     int output_size = l.out_h * l.out_w * l.out_c * batch;
-    l.indexes = calloc(output_size, sizeof(int));
     l.output =  calloc(output_size, sizeof(float));
-    l.delta =   calloc(output_size, sizeof(float));
+    if(train){
+        l.indexes = calloc(output_size, sizeof(int));
+        l.delta =   calloc(output_size, sizeof(float));
+    }
     l.forward = forward_maxpool_layer;
     l.backward = backward_maxpool_layer;
     #ifdef GPU
@@ -62,9 +65,9 @@ void resize_maxpool_layer(maxpool_layer *l, int w, int h)
     l->outputs = l->out_w * l->out_h * l->c;
     int output_size = l->outputs * l->batch;
 
-    l->indexes = realloc(l->indexes, output_size * sizeof(int));
+    if(l->indexes) l->indexes = realloc(l->indexes, output_size * sizeof(int));
     l->output = realloc(l->output, output_size * sizeof(float));
-    l->delta = realloc(l->delta, output_size * sizeof(float));
+    if(l->delta) l->delta = realloc(l->delta, output_size * sizeof(float));
 
     #ifdef GPU
     cuda_free((float *)l->indexes_gpu);
@@ -76,43 +79,153 @@ void resize_maxpool_layer(maxpool_layer *l, int w, int h)
     #endif
 }
 
-void forward_maxpool_layer(const maxpool_layer l, network net)
+/*
+ * 2x2 windows with no offset, the shapes the tiny cfgs use, pool a pair of
+ * input rows per output row; a window hanging over the right or bottom edge
+ * only sees the pixels inside, as with the generic loop. Argmax indexes are
+ * only needed for backprop, so inference skips them.
+ */
+
+// Pools n windows lying fully inside rows r0 and r1
+typedef void (*maxpool_row_fn)(const float *r0, const float *r1, int n, int stride, float *out);
+
+static void maxpool_row_generic(const float *r0, const float *r1, int n, int stride, float *out)
 {
-    int b,i,j,k,m,n;
-    int w_offset = -l.pad/2;
-    int h_offset = -l.pad/2;
+    int x;
+    for(x = 0; x < n; ++x){
+        const float *a = r0 + x*stride;
+        const float *b = r1 + x*stride;
+        float m0 = a[0] > b[0] ? a[0] : b[0];
+        float m1 = a[1] > b[1] ? a[1] : b[1];
+        out[x] = m0 > m1 ? m0 : m1;
+    }
+}
 
-    int h = l.out_h;
-    int w = l.out_w;
-    int c = l.c;
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static void maxpool_row_avx2(const float *r0, const float *r1, int n, int stride, float *out)
+{
+    int x = 0;
+    if(stride == 2){
+        for(; x + 8 <= n; x += 8){
+            __m256 lo = _mm256_max_ps(_mm256_loadu_ps(r0 + 2*x), _mm256_loadu_ps(r1 + 2*x));
+            __m256 hi = _mm256_max_ps(_mm256_loadu_ps(r0 + 2*x + 8), _mm256_loadu_ps(r1 + 2*x + 8));
+            // Even and odd columns of the 16, restored to order across the 128 bit halves
+            __m256 m = _mm256_max_ps(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)),
+                    _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+            m = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(m), _MM_SHUFFLE(3, 1, 2, 0)));
+            _mm256_storeu_ps(out + x, m);
+        }
+    } else {
+        for(; x + 8 <= n; x += 8){
+            __m256 a = _mm256_max_ps(_mm256_loadu_ps(r0 + x), _mm256_loadu_ps(r1 + x));
+            __m256 b = _mm256_max_ps(_mm256_loadu_ps(r0 + x + 1), _mm256_loadu_ps(r1 + x + 1));
+            _mm256_storeu_ps(out + x, _mm256_max_ps(a, b));
+        }
+    }
+    maxpool_row_generic(r0 + x*stride, r1 + x*stride, n - x, stride, out + x);
+}
+#endif
+
+static maxpool_row_fn get_maxpool_row()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static maxpool_row_fn row = __builtin_cpu_supports("avx2") ? maxpool_row_avx2 : maxpool_row_generic;
+    return row;
+#else
+    return maxpool_row_generic;
+#endif
+}
 
-    for(b = 0; b < l.batch; ++b){
-        for(k = 0; k < c; ++k){
-            for(i = 0; i < h; ++i){
-                for(j = 0; j < w; ++j){
-                    int out_index = j + w*(i + h*(k + c*b));
-                    float max = -FLT_MAX;
-                    int max_i = -1;
-                    for(n = 0; n < l.size; ++n){
-                        for(m = 0; m < l.size; ++m){
-                            int cur_h = h_offset + i*l.stride + n;
-                            int cur_w = w_offset + j*l.stride + m;
-                            int index = cur_w + l.w*(cur_h + l.h*(k + b*l.c));
-                            int valid = (cur_h >= 0 && cur_h < l.h &&
-                                         cur_w >= 0 && cur_w < l.w);
-                            float val = (valid != 0) ? net.input[index] : -FLT_MAX;
-                            max_i = (val > max) ? index : max_i;
-                            max   = (val > max) ? val   : max;
-                        }
-                    }
-                    l.output[out_index] = max;
-                    l.indexes[out_index] = max_i;
+static void maxpool_2x2_plane(const float *in, int h, int w, int stride, int out_h, int out_w,
+        maxpool_row_fn row, float *out)
+{
+    int full = w < 2 ? 0 : (w - 2)/stride + 1;
+    int x, y;
+    if(full > out_w) full = out_w;
+    for(y = 0; y < out_h; ++y){
+        int iy = y*stride;
+        const float *r0 = in + iy*w;
+        const float *r1 = iy + 1 < h ? r0 + w : r0;
+        float *o = out + y*out_w;
+        row(r0, r1, full, stride, o);
+        for(x = full; x < out_w; ++x){
+            int ix = x*stride;
+            o[x] = r0[ix] > r1[ix] ? r0[ix] : r1[ix];
+        }
+    }
+}
+
+static void maxpool_plane(const maxpool_layer *l, const float *in, int p, float *out, int *indexes)
+{
+    int w_offset = -l->pad/2;
+    int h_offset = -l->pad/2;
+    int k = p%l->c;
+    int b = p/l->c;
+    int i, j, m, n;
+    for(i = 0; i < l->out_h; ++i){
+        for(j = 0; j < l->out_w; ++j){
+            int out_index = j + l->out_w*i;
+            float max = -FLT_MAX;
+            int max_i = -1;
+            for(n = 0; n < l->size; ++n){
+                for(m = 0; m < l->size; ++m){
+                    int cur_h = h_offset + i*l->stride + n;
+                    int cur_w = w_offset + j*l->stride + m;
+                    int index = cur_w + l->w*(cur_h + l->h*(k + b*l->c));
+                    int valid = (cur_h >= 0 && cur_h < l->h &&
+                                 cur_w >= 0 && cur_w < l->w);
+                    float val = (valid != 0) ? in[cur_w + l->w*cur_h] : -FLT_MAX;
+                    max_i = (val > max) ? index : max_i;
+                    max   = (val > max) ? val   : max;
                 }
             }
+            out[out_index] = max;
+            if(indexes) indexes[out_index] = max_i;
         }
     }
 }
 
+typedef struct {
+    const maxpool_layer *l;
+    float *input;
+    int begin;
+    int train;
+} maxpool_job;
+
+static void maxpool_planes(void *ptr, int begin, int end)
+{
+    maxpool_job *job = (maxpool_job *)ptr;
+    const maxpool_layer *l = job->l;
+    int fast = !job->train && l->size == 2 && l->pad/2 == 0 && (l->stride == 1 || l->stride == 2);
+    maxpool_row_fn row = get_maxpool_row();
+    int p;
+    for(p = job->begin + begin; p < job->begin + end; ++p){
+        float *in = job->input + (size_t)p*l->h*l->w;
+        float *out = l->output + (size_t)p*l->out_h*l->out_w;
+        if(fast) maxpool_2x2_plane(in, l->h, l->w, l->stride, l->out_h, l->out_w, row, out);
+        else maxpool_plane(l, in, p, out, job->train ? l->indexes + (size_t)p*l->out_h*l->out_w : 0);
+    }
+}
+
+// Pools planes [begin, end) of the batch x c input into l.output, keeping
+// the argmax indexes when training
+void maxpool_cpu(const maxpool_layer l, float *input, int begin, int end, int train)
+{
+    maxpool_job job = {&l, input, begin, train};
+    int grain = 4096/(l.out_h*l.out_w) + 1;
+    parallel_for(end - begin, grain, maxpool_planes, &job);
+}
+
+void forward_maxpool_layer(const maxpool_layer l, network net)
+{
+    // Run by the conv layer before it
+    if(l.fused) return;
+    maxpool_cpu(l, net.input, 0, l.batch*l.c, net.train);
+}
+
 void backward_maxpool_layer(const maxpool_layer l, network net)
 {
     int i;
@@ -1,11 +1,13 @@
 #include <stdio.h>
 #include <time.h>
 #include <assert.h>
+#include <sys/mman.h>
 #include "network.h"
 #include "image.h"
 #include "data.h"
 #include "utils.h"
 #include "blas.h"
+#include "thread_pool.h"
 
 #include "crop_layer.h"
 #include "connected_layer.h"
@@ -60,6 +62,391 @@ network *load_network(char *cfg, char *weights, int clear)
     return net;
 }
 
+network *load_network_inference(char *cfg, char *weights)
+{
+    network *net = parse_network_cfg_inference(cfg);
+    if(weights && weights[0] != 0){
+        load_weights(net, weights);
+    }
+    return net;
+}
+
+static int layer_output_shared(network *net, int index)
+{
+    int i, j;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == SHORTCUT && l.index == index) return 1;
+        if(l.type == ROUTE){
+            for(j = 0; j < l.n; ++j){
+                if(l.input_layers[j] == index) return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int can_alias_output(network *net, int index)
+{
+    layer l = net->layers[index];
+    if(l.output_alias) return 0;
+    if(l.type != CONVOLUTIONAL && l.type != MAXPOOL && l.type != UPSAMPLE &&
+            l.type != SHORTCUT && l.type != REORG) return 0;
+    // A dropout after it shares its output buffer
+    return index + 1 == net->n || net->layers[index + 1].type != DROPOUT;
+}
+
+// A shortcut straight after a conv whose output nothing else reads can run
+// in the conv's epilogue, which then writes the shortcut's output directly
+static void fuse_shortcut_layers(network *net)
+{
+    int i;
+    for(i = 0; i + 1 < net->n; ++i){
+        layer *l = net->layers + i;
+        layer *s = net->layers + i + 1;
+        if(l->type != CONVOLUTIONAL || s->type != SHORTCUT) continue;
+        l->fused_shortcut = 0;
+        s->fused = 0;
+        if(net->train || (l->batch_normalize && !l->fused_biases)) continue;
+        if(s->index == i || s->w != s->out_w || s->h != s->out_h || s->c != s->out_c) continue;
+        if(layer_output_shared(net, i)) continue;
+        l->fused_shortcut = s;
+        s->fused = 1;
+    }
+}
+
+// Likewise a maxpool can pool each part of a conv's output as soon as it is
+// written, while it is still in cache
+static void fuse_maxpool_layers(network *net)
+{
+    int i;
+    for(i = 0; i + 1 < net->n; ++i){
+        layer *l = net->layers + i;
+        layer *m = net->layers + i + 1;
+        if(l->type != CONVOLUTIONAL || m->type != MAXPOOL) continue;
+        l->fused_maxpool = 0;
+        m->fused = 0;
+        if(!net->fuse_maxpool || net->train || (l->batch_normalize && !l->fused_biases)) continue;
+        if(layer_output_shared(net, i)) continue;
+        l->fused_maxpool = m;
+        m->fused = 1;
+    }
+}
+
+// The layer before a shortcut that nothing else reads can write straight
+// into the shortcut's output, which the shortcut then updates in place.
+// Going backwards, a chain of shortcuts ends up sharing the last one's
+// buffer. resize_network undoes this; call optimize_network again after it.
+static void alias_shortcut_inputs(network *net)
+{
+    int i;
+    for(i = net->n - 1; i > 0; --i){
+        layer *s = net->layers + i;
+        layer *l = net->layers + i - 1;
+        if(s->type != SHORTCUT || net->train) continue;
+        if(!can_alias_output(net, i - 1) || layer_output_shared(net, i - 1)) continue;
+        free(l->output);
+        l->output = s->output;
+        l->output_alias = 1;
+    }
+}
+
+/*
+ * Layers that don't depend on each other, such as yolov3's detection heads
+ * and the upsample branches beside them, can run at the same time. Each
+ * layer's level is one past the deepest layer it reads, through its input,
+ * a route or a shortcut, and forward_network runs the layers of a level
+ * side by side, levels in order. A level's layers never write the same
+ * memory, so the results match running them one by one.
+ */
+
+int plannable_layer(LAYER_TYPE t)
+{
+    return t == CONVOLUTIONAL || t == CONNECTED || t == MAXPOOL || t == AVGPOOL || t == SOFTMAX ||
+        t == DROPOUT || t == ROUTE || t == SHORTCUT || t == UPSAMPLE || t == REORG ||
+        t == BATCHNORM || t == ACTIVE || t == YOLO || t == REGION || t == DETECTION || t == COST;
+}
+
+static int branch_level(network *net, int *level, int index)
+{
+    layer l = net->layers[index];
+    int deepest = -1;
+    int j;
+    if(l.type == ROUTE){
+        for(j = 0; j < l.n; ++j){
+            if(level[l.input_layers[j]] > deepest) deepest = level[l.input_layers[j]];
+        }
+    } else if(index > 0){
+        deepest = level[index - 1];
+    }
+    if(l.type == SHORTCUT && level[l.index] > deepest) deepest = level[l.index];
+    // A conv running a shortcut in its epilogue reads the shortcut's source
+    if(l.fused_shortcut && level[l.fused_shortcut->index] > deepest) deepest = level[l.fused_shortcut->index];
+    return deepest + 1;
+}
+
+void plan_network_branches(network *net)
+{
+    int *level = (int *)calloc(net->n, sizeof(int));
+    int *count = 0;
+    int num_levels = 0, width = 0;
+    int i;
+
+    if(net->train || net->schedule || net->arena || !net->parallel_branches) goto done;
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(!plannable_layer(l.type) || l.truth) goto done;
+        level[i] = branch_level(net, level, i);
+        if(level[i] + 1 > num_levels) num_levels = level[i] + 1;
+    }
+    count = (int *)calloc(num_levels + 1, sizeof(int));
+    for(i = 0; i < net->n; ++i){
+        if(++count[level[i] + 1] > width) width = count[level[i] + 1];
+    }
+    if(width < 2) goto done;
+
+    for(i = 0; i < num_levels; ++i) count[i + 1] += count[i];
+    net->levels = (int *)calloc(num_levels + 1, sizeof(int));
+    net->schedule = (int *)calloc(net->n, sizeof(int));
+    memcpy(net->levels, count, (num_levels + 1)*sizeof(int));
+    for(i = 0; i < net->n; ++i) net->schedule[count[level[i]]++] = i;
+    net->num_levels = num_levels;
+    net->branch_width = width;
+    // Each branch running at once gets its own slice of the workspace
+    free(net->workspace);
+    net->workspace = 0;
+
+done:
+    free(level);
+    free(count);
+}
+
+/*
+ * At inference only a few layer outputs are live at once, so they can share
+ * one arena. Layers whose outputs alias each other form one buffer, live
+ * from its first write to the last layer reading any part of it, whether
+ * as the next layer's input or through a route or shortcut. Buffers are
+ * placed largest first at the lowest offset clear of every placed buffer
+ * whose lifetime overlaps. Detection layers and the network output keep
+ * their own buffers, as callers read them after the forward pass.
+ */
+
+#define PLAN_ALIGN 16
+
+typedef struct {
+    int owner;
+    int first, last;
+    size_t size, offset;
+} plan_buffer;
+
+static int buffer_owner(network *net, int index)
+{
+    layer l = net->layers[index];
+    int i;
+    if(!l.output) return -1;
+    if(l.type == DROPOUT) return index ? buffer_owner(net, index - 1) : -1;
+    if(!l.output_alias) return index;
+    for(i = 0; i < net->n; ++i){
+        layer o = net->layers[i];
+        if(o.output_alias || o.type == DROPOUT || !o.output) continue;
+        if(l.output >= o.output && l.output < o.output + o.outputs*o.batch) return i;
+    }
+    return -1;
+}
+
+// Latest step, in the order forward_network runs them, of the layers reading
+// a layer's output
+static int last_reader(network *net, int *step, int index)
+{
+    int last = step[index + 1 < net->n ? index + 1 : index];
+    int i, j;
+    for(i = index + 1; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.type == SHORTCUT && l.index == index && step[i] > last) last = step[i];
+        if(l.type == ROUTE){
+            for(j = 0; j < l.n; ++j){
+                if(l.input_layers[j] == index && step[i] > last) last = step[i];
+            }
+        }
+    }
+    return last;
+}
+
+static int compare_plan_size(const void *a, const void *b)
+{
+    const plan_buffer *x = (const plan_buffer *)a;
+    const plan_buffer *y = (const plan_buffer *)b;
+    if(x->size != y->size) return x->size < y->size ? 1 : -1;
+    return x->owner - y->owner;
+}
+
+static size_t place_buffer(plan_buffer *placed, int n, plan_buffer *b)
+{
+    size_t offset = 0;
+    int moved = 1;
+    int i;
+    // Slide up past every live placed buffer it collides with until none do
+    while(moved){
+        moved = 0;
+        for(i = 0; i < n; ++i){
+            plan_buffer *p = placed + i;
+            if(p->first > b->last || b->first > p->last) continue;
+            if(offset < p->offset + p->size && p->offset < offset + b->size){
+                offset = p->offset + p->size;
+                moved = 1;
+            }
+        }
+    }
+    return offset;
+}
+
+void plan_network_memory(network *net)
+{
+    int *owner = (int *)calloc(net->n, sizeof(int));
+    plan_buffer *buf = (plan_buffer *)calloc(net->n, sizeof(plan_buffer));
+    int *pinned = (int *)calloc(net->n, sizeof(int));
+    int *step = (int *)calloc(net->n, sizeof(int));
+    int nbuf = 0;
+    int out = net->n - 1;
+    size_t total = 0, separate = 0;
+    int i, j;
+
+    if(net->train || net->arena || !net->plan_memory) goto done;
+    while(out > 0 && net->layers[out].type == COST) --out;
+    // Layers running side by side share a step, their level
+    for(i = 0; i < net->n; ++i) step[i] = i;
+    for(i = 0; i < net->num_levels; ++i){
+        for(j = net->levels[i]; j < net->levels[i + 1]; ++j) step[net->schedule[j]] = i;
+    }
+    for(i = 0; i < net->n; ++i){
+        if(!plannable_layer(net->layers[i].type)) goto done;
+        owner[i] = buffer_owner(net, i);
+    }
+    for(i = 0; i < net->n; ++i){
+        LAYER_TYPE t = net->layers[i].type;
+        if(owner[i] < 0) continue;
+        if(i >= out || t == YOLO || t == REGION || t == DETECTION) pinned[owner[i]] = 1;
+    }
+
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(owner[i] != i || pinned[i]) continue;
+        plan_buffer *b = buf + nbuf++;
+        b->owner = i;
+        b->first = net->n;
+        b->last = 0;
+        b->size = ((size_t)l.outputs*l.batch + PLAN_ALIGN - 1)/PLAN_ALIGN*PLAN_ALIGN;
+        for(j = 0; j < net->n; ++j){
+            if(owner[j] != i) continue;
+            // Fused layers are written by the conv before them
+            int first = step[net->layers[j].fused ? j - 1 : j];
+            int last = last_reader(net, step, j);
+            if(first < b->first) b->first = first;
+            if(last > b->last) b->last = last;
+        }
+        separate += b->size;
+    }
+    qsort(buf, nbuf, sizeof(plan_buffer), compare_plan_size);
+    for(i = 0; i < nbuf; ++i){
+        buf[i].offset = place_buffer(buf, i, buf + i);
+        if(buf[i].offset + buf[i].size > total) total = buf[i].offset + buf[i].size;
+    }
+    if(!nbuf) goto done;
+
+    net->arena = (float *)calloc(total, sizeof(float));
+    net->arena_size = total;
+    for(i = 0; i < nbuf; ++i){
+        layer *o = net->layers + buf[i].owner;
+        float *old = o->output;
+        float *base = net->arena + buf[i].offset;
+        for(j = 0; j < net->n; ++j){
+            layer *l = net->layers + j;
+            if(owner[j] != buf[i].owner || l == o) continue;
+            l->output = base + (l->output - old);
+            if(l->type != DROPOUT) l->output_alias = 1;
+        }
+        o->output = base;
+        o->output_alias = 1;
+        free(old);
+    }
+    fprintf(stderr, "Activation arena: %.1f MB for %.1f MB of layer outputs\n",
+            total*sizeof(float)/1e6, separate*sizeof(float)/1e6);
+
+done:
+    free(owner);
+    free(buf);
+    free(pinned);
+    free(step);
+}
+
+// Folds batch norm away and frees what only backward reads, so from here on
+// the network only runs inference
+void optimize_network(network *net)
+{
+    int i;
+#ifdef GPU
+    if(net->gpu_index >= 0) return;
+#endif
+    if(net->train) error("Only inference networks can be optimized");
+    net->inference = 1;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(l->type == CONVOLUTIONAL){
+            optimize_convolutional_layer(l, net);
+        } else if(l->type == CONNECTED){
+            optimize_connected_layer(l, net);
+        }
+    }
+    fuse_shortcut_layers(net);
+    fuse_maxpool_layers(net);
+    alias_shortcut_inputs(net);
+    plan_network_branches(net);
+    plan_network_memory(net);
+}
+
+// With batch 1 a layer feeding a route can write straight into its slice of
+// the route's output, leaving the route nothing to copy. Each layer is
+// aliased into the first route that reads it.
+void alias_route_inputs(network *net)
+{
+    int i, j;
+#ifdef GPU
+    if(net->gpu_index >= 0) return;
+#endif
+    if(net->batch != 1) return;
+    for(i = 0; i < net->n; ++i){
+        layer r = net->layers[i];
+        int offset = 0;
+        if(r.type != ROUTE) continue;
+        for(j = 0; j < r.n; ++j){
+            int index = r.input_layers[j];
+            if(can_alias_output(net, index)){
+                layer *l = net->layers + index;
+                free(l->output);
+                l->output = r.output + offset;
+                l->output_alias = 1;
+            }
+            offset += r.input_sizes[j];
+        }
+    }
+}
+
+// Gives aliased layers, and those in the activation arena, their own
+// buffers back before they get resized
+void unalias_layer_outputs(network *net)
+{
+    int i;
+    for(i = 0; i < net->n; ++i){
+        layer *l = net->layers + i;
+        if(!l->output_alias) continue;
+        l->output = calloc(l->outputs*l->batch, sizeof(float));
+        l->output_alias = 0;
+    }
+    free(net->arena);
+    net->arena = 0;
+    net->arena_size = 0;
+}
+
 size_t get_current_batch(network *net)
 {
     size_t batch_num = (*net->seen)/(net->batch*net->subdivisions);
@@ -185,6 +572,74 @@ network *make_network(int n)
     return net;
 }
 
+// The CPU workspace only backs im2col for backward passes and the layers that
+// still need it going forward, so it is allocated the first time one runs
+static int needs_workspace(network *net, layer l)
+{
+    return l.workspace_size && (net->train || l.type != CONVOLUTIONAL || l.algo == CONV_IM2COL);
+}
+
+static size_t workspace_stride(network *net)
+{
+    return (net->workspace_size + 63)/64*64;
+}
+
+static void make_network_workspace(network *net)
+{
+    int slots = net->branch_width > 1 ? net->branch_width : 1;
+    if(!net->workspace && net->workspace_size) net->workspace = calloc(slots, workspace_stride(net));
+}
+
+typedef struct {
+    network *net;
+    int *layers;
+} branch_job;
+
+static void forward_branches(void *ptr, int begin, int end)
+{
+    branch_job *job = (branch_job *)ptr;
+    int t;
+    for(t = begin; t < end; ++t){
+        int i = job->layers[t];
+        network net = *job->net;
+        layer l = net.layers[i];
+        net.index = i;
+        net.input = i ? net.layers[i - 1].output : job->net->input;
+        net.workspace = net.workspace ? (float *)((char *)net.workspace + t*workspace_stride(&net)) : 0;
+        if(l.delta){
+            fill_cpu(l.outputs * l.batch, 0, l.delta, 1);
+        }
+        l.forward(l, net);
+    }
+}
+
+// Runs steps [begin, end) of forward_network's order one after another
+void forward_network_steps(network *netp, int begin, int end)
+{
+    int i;
+    for(i = begin; i < end; ++i){
+        int index = netp->schedule ? netp->schedule[i] : i;
+        branch_job job = {netp, &index};
+        if(needs_workspace(netp, netp->layers[index])) make_network_workspace(netp);
+        forward_branches(&job, 0, 1);
+    }
+}
+
+static void forward_network_levels(network *netp)
+{
+    int i, j;
+    for(i = 0; i < netp->num_levels; ++i){
+        branch_job job = {netp, netp->schedule + netp->levels[i]};
+        int n = netp->levels[i + 1] - netp->levels[i];
+        for(j = 0; j < n; ++j){
+            if(needs_workspace(netp, netp->layers[job.layers[j]])) make_network_workspace(netp);
+        }
+        if(n > 1 && parallel_threads() > 1) parallel_tasks(n, forward_branches, &job);
+        else forward_branches(&job, 0, n);
+    }
+    calc_network_cost(netp);
+}
+
 void forward_network(network *netp)
 {
 #ifdef GPU
@@ -193,6 +648,11 @@ void forward_network(network *netp)
         return;
     }
 #endif
+    // The activation arena is planned for this order, so keep to it
+    if(netp->schedule && !netp->train){
+        forward_network_levels(netp);
+        return;
+    }
     network net = *netp;
     int i;
     for(i = 0; i < net.n; ++i){
@@ -201,6 +661,10 @@ void forward_network(network *netp)
         if(l.delta){
             fill_cpu(l.outputs * l.batch, 0, l.delta, 1);
         }
+        if(needs_workspace(netp, l)){
+            make_network_workspace(netp);
+            net.workspace = netp->workspace;
+        }
         l.forward(l, net);
         net.input = l.output;
         if(l.truth) {
@@ -268,6 +732,7 @@ void backward_network(network *netp)
         return;
     }
 #endif
+    make_network_workspace(netp);
     network net = *netp;
     int i;
     network orig = net;
@@ -288,6 +753,7 @@ void backward_network(network *netp)
 
 float train_network_datum(network *net)
 {
+    if(net->inference) error("Network is set up for inference only");
     *net->seen += net->batch;
     net->train = 1;
     forward_network(net);
@@ -369,6 +835,7 @@ int resize_network(network *net, int w, int h)
     size_t workspace_size = 0;
     //fprintf(stderr, "Resizing to %d x %d...\n", w, h);
     //fflush(stderr);
+    unalias_layer_outputs(net);
     for (i = 0; i < net->n; ++i){
         layer l = net->layers[i];
         if(l.type == CONVOLUTIONAL){
@@ -406,6 +873,7 @@ int resize_network(network *net, int w, int h)
         h = l.out_h;
         if(l.type == AVGPOOL) break;
     }
+    alias_route_inputs(net);
     layer out = get_network_output_layer(net);
     net->inputs = net->layers[0].inputs;
     net->outputs = out.outputs;
@@ -427,12 +895,13 @@ int resize_network(network *net, int w, int h)
         }
     }else {
         free(net->workspace);
-        net->workspace = calloc(1, workspace_size);
+        net->workspace = 0;
     }
 #else
     free(net->workspace);
-    net->workspace = calloc(1, workspace_size);
+    net->workspace = 0;
 #endif
+    net->workspace_size = workspace_size;
     //fprintf(stderr, " Done!\n");
     return 0;
 }
@@ -503,6 +972,7 @@ float *network_predict(network *net, float *input)
     net->delta = 0;
     forward_network(net);
     float *out = net->output;
+    orig.workspace = net->workspace;
     *net = orig;
     return out;
 }
@@ -720,8 +1190,18 @@ void free_network(network *net)
         free_layer(net->layers[i]);
     }
     free(net->layers);
+    free(net->tune_cache);
+    free(net->arena);
+    free(net->schedule);
+    free(net->levels);
+    if(net->weights_map) munmap(net->weights_map, net->weights_map_size);
     if(net->input) free(net->input);
     if(net->truth) free(net->truth);
+#ifdef GPU
+    if(net->workspace && net->gpu_index < 0) free(net->workspace);
+#else
+    if(net->workspace) free(net->workspace);
+#endif
 #ifdef GPU
     if(net->input_gpu) cuda_free(net->input_gpu);
     if(net->truth_gpu) cuda_free(net->truth_gpu);
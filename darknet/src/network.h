@@ -23,6 +23,12 @@ float network_accuracy_multi(network *net, data d, int n);
 int get_predicted_class_network(network *net);
 void print_network(network *net);
 int resize_network(network *net, int w, int h);
+void alias_route_inputs(network *net);
+void unalias_layer_outputs(network *net);
+int plannable_layer(LAYER_TYPE t);
+void plan_network_branches(network *net);
+void forward_network_steps(network *net, int begin, int end);
+void plan_network_memory(network *net);
 void calc_network_cost(network *net);
 
 #endif
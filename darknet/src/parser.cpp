@@ -2,6 +2,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "activation_layer.h"
 #include "logistic_layer.h"
@@ -199,9 +201,13 @@ convolutional_layer parse_convolutional(list *options, size_params params)
     int binary = option_find_int_quiet(options, "binary", 0);
     int xnor = option_find_int_quiet(options, "xnor", 0);
 
-    convolutional_layer layer = make_convolutional_layer(batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, params.net->adam);
+    convolutional_layer layer = make_convolutional_layer(batch,h,w,c,n,groups,size,stride,padding,activation, batch_normalize, binary, xnor, params.net->adam, !params.net->inference);
     layer.flipped = option_find_int_quiet(options, "flipped", 0);
     layer.dot = option_find_float_quiet(options, "dot", 0);
+#ifdef GPU
+    if(gpu_index < 0)
+#endif
+    set_convolutional_weight_format(&layer, params.net->weight_format);
 
     return layer;
 }
@@ -263,7 +269,7 @@ layer parse_connected(list *options, size_params params)
     ACTIVATION activation = get_activation(activation_s);
     int batch_normalize = option_find_int_quiet(options, "batch_normalize", 0);
 
-    layer l = make_connected_layer(params.batch, params.inputs, output, activation, batch_normalize, params.net->adam);
+    layer l = make_connected_layer(params.batch, params.inputs, output, activation, batch_normalize, params.net->adam, !params.net->inference);
     return l;
 }
 
@@ -311,7 +317,7 @@ layer parse_yolo(list *options, size_params params)
 
     char *a = option_find_str(options, "mask", 0);
     int *mask = parse_yolo_mask(a, &num);
-    layer l = make_yolo_layer(params.batch, params.w, params.h, num, total, mask, classes);
+    layer l = make_yolo_layer(params.batch, params.w, params.h, num, total, mask, classes, !params.net->inference);
     assert(l.outputs == params.inputs);
 
     l.max_boxes = option_find_int_quiet(options, "max",90);
@@ -356,7 +362,7 @@ layer parse_region(list *options, size_params params)
     int classes = option_find_int(options, "classes", 20);
     int num = option_find_int(options, "num", 1);
 
-    layer l = make_region_layer(params.batch, params.w, params.h, num, classes, coords);
+    layer l = make_region_layer(params.batch, params.w, params.h, num, classes, coords, !params.net->inference);
     assert(l.outputs == params.inputs);
 
     l.log = option_find_int_quiet(options, "log", 0);
@@ -493,7 +499,7 @@ maxpool_layer parse_maxpool(list *options, size_params params)
     batch=params.batch;
     if(!(h && w && c)) error("Layer before maxpool layer must output image.");
 
-    maxpool_layer layer = make_maxpool_layer(batch,h,w,c,size,stride,padding);
+    maxpool_layer layer = make_maxpool_layer(batch,h,w,c,size,stride,padding,!params.net->inference);
     return layer;
 }
 
@@ -532,7 +538,7 @@ layer parse_normalization(list *options, size_params params)
 
 layer parse_batchnorm(list *options, size_params params)
 {
-    layer l = make_batchnorm_layer(params.batch, params.w, params.h, params.c);
+    layer l = make_batchnorm_layer(params.batch, params.w, params.h, params.c, !params.net->inference);
     return l;
 }
 
@@ -545,7 +551,7 @@ layer parse_shortcut(list *options, size_params params, network *net)
     int batch = params.batch;
     layer from = net->layers[index];
 
-    layer s = make_shortcut_layer(batch, index, params.w, params.h, params.c, from.out_w, from.out_h, from.out_c);
+    layer s = make_shortcut_layer(batch, index, params.w, params.h, params.c, from.out_w, from.out_h, from.out_c, !net->inference);
 
     char *activation_s = option_find_str(options, "activation", "linear");
     ACTIVATION activation = get_activation(activation_s);
@@ -593,7 +599,7 @@ layer parse_upsample(list *options, size_params params, network *net)
 {
 
     int stride = option_find_int(options, "stride",2);
-    layer l = make_upsample_layer(params.batch, params.w, params.h, params.c, stride);
+    layer l = make_upsample_layer(params.batch, params.w, params.h, params.c, stride, !net->inference);
     l.scale = option_find_float_quiet(options, "scale", 1);
     return l;
 }
@@ -620,7 +626,7 @@ route_layer parse_route(list *options, size_params params, network *net)
     }
     int batch = params.batch;
 
-    route_layer layer = make_route_layer(batch, n, layers, sizes);
+    route_layer layer = make_route_layer(batch, n, layers, sizes, !net->inference);
 
     convolutional_layer first = net->layers[layers[0]];
     layer.out_w = first.out_w;
@@ -652,6 +658,27 @@ learning_rate_policy get_policy(char *s)
     return CONSTANT;
 }
 
+CONV_ALGO get_conv_algo(char *s)
+{
+    if (strcmp(s, "gemm")==0) return CONV_GEMM;
+    if (strcmp(s, "im2col")==0) return CONV_IM2COL;
+    if (strcmp(s, "winograd")==0) return CONV_WINOGRAD;
+    if (strcmp(s, "depthwise")==0) return CONV_DEPTHWISE;
+    if (strcmp(s, "tune")==0) return CONV_TUNE;
+    if (strcmp(s, "auto")==0) return CONV_AUTO;
+    fprintf(stderr, "Couldn't find conv_algo %s, going with auto\n", s);
+    return CONV_AUTO;
+}
+
+WEIGHT_FORMAT get_weight_format(char *s)
+{
+    if (strcmp(s, "fp32")==0) return WEIGHTS_FP32;
+    if (strcmp(s, "fp16")==0) return WEIGHTS_FP16;
+    if (strcmp(s, "bf16")==0) return WEIGHTS_BF16;
+    fprintf(stderr, "Couldn't find weight_format %s, going with fp32\n", s);
+    return WEIGHTS_FP32;
+}
+
 void parse_net_options(list *options, network *net)
 {
     net->batch = option_find_int(options, "batch",1);
@@ -684,6 +711,19 @@ void parse_net_options(list *options, network *net)
     net->center = option_find_int_quiet(options, "center",0);
     net->clip = option_find_float_quiet(options, "clip", 0);
 
+    char *algo_s = option_find(options, "conv_algo");
+    net->conv_algo = algo_s ? get_conv_algo(algo_s) : CONV_AUTO;
+    char *cache_s = option_find(options, "tune_cache");
+    net->tune_cache = cache_s ? copy_string(cache_s) : 0;
+    net->prepack = option_find_int_quiet(options, "prepack", 1);
+    net->fuse_maxpool = option_find_int_quiet(options, "fuse_maxpool", 1);
+    net->plan_memory = option_find_int_quiet(options, "plan_memory", 1);
+    net->parallel_branches = option_find_int_quiet(options, "parallel_branches", 1);
+    net->inference = !option_find_int_quiet(options, "train", 1);
+    char *format_s = option_find(options, "weight_format");
+    net->weight_format = format_s ? get_weight_format(format_s) : WEIGHTS_FP32;
+    net->threads = option_find_int_quiet(options, "threads", 0);
+
     net->angle = option_find_float_quiet(options, "angle", 0);
     net->aspect = option_find_float_quiet(options, "aspect", 1);
     net->saturation = option_find_float_quiet(options, "saturation", 1);
@@ -739,7 +779,7 @@ int is_network(section *s)
             || strcmp(s->type, "[network]")==0);
 }
 
-network *parse_network_cfg(char *filename)
+static network *parse_network(char *filename, int inference)
 {
     list *sections = read_cfg(filename);
     node *n = sections->front;
@@ -752,6 +792,11 @@ network *parse_network_cfg(char *filename)
     list *options = s->options;
     if(!is_network(s)) error("First section must be [net] or [network]");
     parse_net_options(options, net);
+    if(inference) net->inference = 1;
+    if(!net->inference && net->weight_format != WEIGHTS_FP32){
+        fprintf(stderr, "weight_format only applies to inference networks, going with fp32\n");
+        net->weight_format = WEIGHTS_FP32;
+    }
 
     params.h = net->h;
     params.w = net->w;
@@ -861,6 +906,7 @@ network *parse_network_cfg(char *filename)
         }
     }
     free_list(sections);
+    alias_route_inputs(net);
     layer out = get_network_output_layer(net);
     net->outputs = out.outputs;
     net->truths = out.outputs;
@@ -873,21 +919,26 @@ network *parse_network_cfg(char *filename)
     net->input_gpu = cuda_make_array(net->input, net->inputs*net->batch);
     net->truth_gpu = cuda_make_array(net->truth, net->truths*net->batch);
 #endif
-    if(workspace_size){
-        //printf("%ld\n", workspace_size);
+    net->workspace_size = workspace_size;
 #ifdef GPU
-        if(gpu_index >= 0){
-            net->workspace = cuda_make_array(0, (workspace_size-1)/sizeof(float)+1);
-        }else {
-            net->workspace = calloc(1, workspace_size);
-        }
-#else
-        net->workspace = calloc(1, workspace_size);
-#endif
+    if(workspace_size && gpu_index >= 0){
+        net->workspace = cuda_make_array(0, (workspace_size-1)/sizeof(float)+1);
     }
+#endif
     return net;
 }
 
+network *parse_network_cfg(char *filename)
+{
+    return parse_network(filename, 0);
+}
+
+// Leaves out gradients and optimiser state, so the network can't be trained
+network *parse_network_cfg_inference(char *filename)
+{
+    return parse_network(filename, 1);
+}
+
 list *read_cfg(char *filename)
 {
     FILE *file = fopen(filename, "r");
@@ -973,7 +1024,14 @@ void save_convolutional_weights(layer l, FILE *fp)
         fwrite(l.rolling_mean, sizeof(float), l.n, fp);
         fwrite(l.rolling_variance, sizeof(float), l.n, fp);
     }
-    fwrite(l.weights, sizeof(float), num, fp);
+    if (l.half_weights){
+        float *weights = calloc(num, sizeof(float));
+        half_to_float_cpu(num, l.weight_format, l.half_weights, weights);
+        fwrite(weights, sizeof(float), num, fp);
+        free(weights);
+    } else {
+        fwrite(l.weights, sizeof(float), num, fp);
+    }
 }
 
 void save_batchnorm_weights(layer l, FILE *fp)
@@ -1201,10 +1259,15 @@ void load_convolutional_weights(layer l, FILE *fp)
             printf("\n");
         }
     }
-    fread(l.weights, sizeof(float), num, fp);
+    float *weights = l.half_weights ? calloc(l.nweights, sizeof(float)) : l.weights;
+    fread(weights, sizeof(float), num, fp);
     //if(l.c == 3) scal_cpu(num, 1./256, l.weights, 1);
     if (l.flipped) {
-        transpose_matrix(l.weights, l.c*l.size*l.size, l.n);
+        transpose_matrix(weights, l.c*l.size*l.size, l.n);
+    }
+    if (l.half_weights) {
+        float_to_half_cpu(num, l.weight_format, weights, l.half_weights);
+        free(weights);
     }
     //if (l.binary) binarize_weights(l.weights, l.n, l.c*l.size*l.size, l.weights);
 #ifdef GPU
@@ -1214,6 +1277,79 @@ void load_convolutional_weights(layer l, FILE *fp)
 #endif
 }
 
+/*
+ * Inference networks point their conv and connected layers straight into a
+ * private mapping of the weights file instead of reading them. Processes
+ * loading the same file share one copy through the page cache, pages are
+ * only read once something touches them, and a write, which inference
+ * never makes, would just copy the page.
+ */
+
+static char *map_weights(network *net, FILE *fp)
+{
+    struct stat st;
+#ifdef GPU
+    if(net->gpu_index >= 0) return 0;
+#endif
+    if(!net->inference || net->weights_map) return 0;
+    if(fstat(fileno(fp), &st) || !st.st_size) return 0;
+    void *map = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fp), 0);
+    if(map == MAP_FAILED) return 0;
+#ifdef MADV_HUGEPAGE
+    madvise(map, st.st_size, MADV_HUGEPAGE);
+#endif
+    madvise(map, st.st_size, MADV_WILLNEED);
+    net->weights_map = map;
+    net->weights_map_size = st.st_size;
+    return (char *)map;
+}
+
+// Whether the next n floats of the file are all in the mapping
+static int mapped_floats(network *net, FILE *fp, size_t n)
+{
+    long offset = ftell(fp);
+    return offset >= 0 && offset%sizeof(float) == 0 && offset + n*sizeof(float) <= net->weights_map_size;
+}
+
+static float *map_floats(char *map, FILE *fp, float *old, int n)
+{
+    float *p = (float *)(map + ftell(fp));
+    free(old);
+    fseek(fp, n*sizeof(float), SEEK_CUR);
+    return p;
+}
+
+static int bind_convolutional_weights(network *net, layer *l, char *map, FILE *fp)
+{
+    int bn = l->batch_normalize;
+    if(l->numload || l->flipped || l->half_weights || (bn && l->dontloadscales)) return 0;
+    if(!mapped_floats(net, fp, l->n*(bn ? 4 : 1) + l->nweights)) return 0;
+    l->biases = map_floats(map, fp, l->biases, l->n);
+    if(bn){
+        l->scales = map_floats(map, fp, l->scales, l->n);
+        l->rolling_mean = map_floats(map, fp, l->rolling_mean, l->n);
+        l->rolling_variance = map_floats(map, fp, l->rolling_variance, l->n);
+    }
+    l->weights = map_floats(map, fp, l->weights, l->nweights);
+    l->weights_mapped = 1;
+    return 1;
+}
+
+static int bind_connected_weights(network *net, layer *l, char *map, FILE *fp)
+{
+    int bn = l->batch_normalize;
+    if(bn && l->dontloadscales) return 0;
+    if(!mapped_floats(net, fp, l->outputs*(bn ? 4 : 1) + (size_t)l->outputs*l->inputs)) return 0;
+    l->biases = map_floats(map, fp, l->biases, l->outputs);
+    l->weights = map_floats(map, fp, l->weights, l->outputs*l->inputs);
+    if(bn){
+        l->scales = map_floats(map, fp, l->scales, l->outputs);
+        l->rolling_mean = map_floats(map, fp, l->rolling_mean, l->outputs);
+        l->rolling_variance = map_floats(map, fp, l->rolling_variance, l->outputs);
+    }
+    l->weights_mapped = 1;
+    return 1;
+}
 
 void load_weights_upto(network *net, char *filename, int start, int cutoff)
 {
@@ -1241,11 +1377,14 @@ void load_weights_upto(network *net, char *filename, int start, int cutoff)
         *net->seen = iseen;
     }
     int transpose = (major > 1000) || (minor > 1000);
+    char *map = map_weights(net, fp);
 
     int i;
     for(i = start; i < net->n && i < cutoff; ++i){
         layer l = net->layers[i];
         if (l.dontload) continue;
+        if(map && l.type == CONVOLUTIONAL && bind_convolutional_weights(net, net->layers + i, map, fp)) continue;
+        if(map && l.type == CONNECTED && !transpose && bind_connected_weights(net, net->layers + i, map, fp)) continue;
         if(l.type == CONVOLUTIONAL || l.type == DECONVOLUTIONAL){
             load_convolutional_weights(l, fp);
         }
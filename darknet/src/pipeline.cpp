@@ -0,0 +1,297 @@
+#include "network.h"
+#include "thread_pool.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Streams frames through a network cut into stages, each running on its
+ * own thread and pool, so a stage can start the next frame while the later
+ * stages finish the one before. Stages are contiguous runs of the order
+ * forward_network uses, balanced on each layer's measured time. Every
+ * frame in flight has its own replica of the network: the layers share
+ * the weights but get their own outputs, laid out the way the original's
+ * are, so routes, shortcuts and the activation arena work unchanged.
+ */
+
+#define PIPELINE_RUNS 2
+
+struct network_pipeline {
+    network *net;
+    int stages;
+    int *bounds;
+    network **replicas;
+    int *done;
+    thread_pool **pools;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int submitted;
+    int returned;
+    int stop;
+};
+
+typedef struct {
+    network_pipeline *p;
+    int stage;
+} pipeline_stage;
+
+static int in_buffer(float *ptr, float *base, size_t size)
+{
+    return base && ptr >= base && ptr < base + size;
+}
+
+// Moves a pointer into one of net's output buffers to the same place in r's
+static float *replica_pointer(network *net, network *r, float *ptr)
+{
+    int i;
+    if(in_buffer(ptr, net->arena, net->arena_size)) return r->arena + (ptr - net->arena);
+    for(i = 0; i < net->n; ++i){
+        layer l = net->layers[i];
+        if(l.output_alias || l.type == DROPOUT) continue;
+        if(in_buffer(ptr, l.output, (size_t)l.outputs*l.batch)) return r->layers[i].output + (ptr - l.output);
+    }
+    return 0;
+}
+
+static float *replica_buffer(float *src, size_t n)
+{
+    return src ? (float *)calloc(n, sizeof(float)) : 0;
+}
+
+static network *make_replica(network *net)
+{
+    network *r = (network *)calloc(1, sizeof(network));
+    int i;
+    *r = *net;
+    r->layers = (layer *)calloc(net->n, sizeof(layer));
+    memcpy(r->layers, net->layers, net->n*sizeof(layer));
+    r->input = (float *)calloc(net->inputs*net->batch, sizeof(float));
+    r->truth = 0;
+    r->delta = 0;
+    r->workspace = 0;
+    r->arena = net->arena_size ? (float *)calloc(net->arena_size, sizeof(float)) : 0;
+
+    for(i = 0; i < net->n; ++i){
+        layer *l = r->layers + i;
+        if(!l->output_alias && l->type != DROPOUT) l->output = replica_buffer(l->output, (size_t)l->outputs*l->batch);
+        l->delta = 0;
+        l->binary_input = replica_buffer(l->binary_input, (size_t)l->inputs*l->batch);
+        l->x = replica_buffer(l->x, (size_t)l->outputs*l->batch);
+        l->x_norm = replica_buffer(l->x_norm, (size_t)l->outputs*l->batch);
+    }
+    for(i = 0; i < net->n; ++i){
+        layer *l = r->layers + i;
+        if(l->output_alias || l->type == DROPOUT) l->output = replica_pointer(net, r, net->layers[i].output);
+        if(l->fused_shortcut) l->fused_shortcut = r->layers + (l->fused_shortcut - net->layers);
+        if(l->fused_maxpool) l->fused_maxpool = r->layers + (l->fused_maxpool - net->layers);
+    }
+    r->output = replica_pointer(net, r, net->output);
+    return r;
+}
+
+static void free_replica(network *r)
+{
+    int i;
+    for(i = 0; i < r->n; ++i){
+        layer l = r->layers[i];
+        if(!l.output_alias && l.type != DROPOUT) free(l.output);
+        free(l.binary_input);
+        free(l.x);
+        free(l.x_norm);
+    }
+    free(r->layers);
+    free(r->arena);
+    free(r->input);
+    free(r->workspace);
+    free(r);
+}
+
+// Cuts n steps into stages contiguous runs with the smallest largest total
+static void balance_stages(float *cost, int n, int stages, int *bounds)
+{
+    float *best = (float *)calloc((stages + 1)*(n + 1), sizeof(float));
+    int *cut = (int *)calloc((stages + 1)*(n + 1), sizeof(int));
+    float *prefix = (float *)calloc(n + 1, sizeof(float));
+    int s, i, j;
+    for(i = 0; i < n; ++i) prefix[i + 1] = prefix[i] + cost[i];
+    for(i = 0; i <= n; ++i) best[n + 1 + i] = prefix[i];
+    for(s = 2; s <= stages; ++s){
+        for(i = s; i <= n; ++i){
+            float b = -1;
+            for(j = s - 1; j < i; ++j){
+                float t = best[(s - 1)*(n + 1) + j];
+                float last = prefix[i] - prefix[j];
+                if(last > t) t = last;
+                if(b < 0 || t < b){
+                    b = t;
+                    cut[s*(n + 1) + i] = j;
+                }
+            }
+            best[s*(n + 1) + i] = b;
+        }
+    }
+    bounds[stages] = n;
+    for(s = stages, i = n; s > 1; --s){
+        i = cut[s*(n + 1) + i];
+        bounds[s - 1] = i;
+    }
+    bounds[0] = 0;
+    free(best);
+    free(cut);
+    free(prefix);
+}
+
+static void time_steps(network *r, float *cost)
+{
+    int i, k;
+    for(i = 0; i < r->n; ++i) cost[i] = 0;
+    forward_network_steps(r, 0, r->n);
+    for(k = 0; k < PIPELINE_RUNS; ++k){
+        for(i = 0; i < r->n; ++i){
+            double start = what_time_is_it_now();
+            forward_network_steps(r, i, i + 1);
+            float t = what_time_is_it_now() - start;
+            if(k == 0 || t < cost[i]) cost[i] = t;
+        }
+    }
+}
+
+static void *pipeline_stage_thread(void *ptr)
+{
+    pipeline_stage a = *(pipeline_stage *)ptr;
+    network_pipeline *p = a.p;
+    int s = a.stage;
+    int frame = 0;
+    free(ptr);
+    swap_thread_pool(p->pools[s]);
+    pthread_mutex_lock(&p->mutex);
+    while(1){
+        int slot = frame%p->stages;
+        while(!p->stop && (frame >= p->submitted || p->done[slot] != s)) pthread_cond_wait(&p->cond, &p->mutex);
+        if(p->stop) break;
+        pthread_mutex_unlock(&p->mutex);
+        forward_network_steps(p->replicas[slot], p->bounds[s], p->bounds[s + 1]);
+        pthread_mutex_lock(&p->mutex);
+        p->done[slot] = s + 1;
+        pthread_cond_broadcast(&p->cond);
+        ++frame;
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return 0;
+}
+
+network_pipeline *make_network_pipeline(network *net, int stages)
+{
+    network_pipeline *p = (network_pipeline *)calloc(1, sizeof(network_pipeline));
+    int i;
+#ifdef GPU
+    if(net->gpu_index >= 0) error("Pipelines only run on the CPU");
+#endif
+    if(net->train) error("Pipelines only run inference");
+    for(i = 0; i < net->n; ++i){
+        if(!plannable_layer(net->layers[i].type) || net->layers[i].truth) error("Network can't be pipelined");
+    }
+    if(stages < 1) stages = 1;
+    if(stages > net->n) stages = net->n;
+    p->net = net;
+    p->stages = stages;
+    p->bounds = (int *)calloc(stages + 1, sizeof(int));
+    p->replicas = (network **)calloc(stages, sizeof(network *));
+    p->done = (int *)calloc(stages, sizeof(int));
+    for(i = 0; i < stages; ++i){
+        p->replicas[i] = make_replica(net);
+        p->done[i] = stages;
+    }
+
+    float *cost = (float *)calloc(net->n, sizeof(float));
+    time_steps(p->replicas[0], cost);
+    balance_stages(cost, net->n, stages, p->bounds);
+    fprintf(stderr, "Pipeline:");
+    for(i = 0; i < stages; ++i){
+        float t = 0;
+        int j;
+        for(j = p->bounds[i]; j < p->bounds[i + 1]; ++j) t += cost[j];
+        fprintf(stderr, " %d-%d %.1fms", p->bounds[i], p->bounds[i + 1] - 1, t*1000);
+    }
+    fprintf(stderr, "\n");
+    free(cost);
+
+    int threads = parallel_threads()/stages;
+    pthread_mutex_init(&p->mutex, 0);
+    pthread_cond_init(&p->cond, 0);
+    p->pools = (thread_pool **)calloc(stages, sizeof(thread_pool *));
+    p->threads = (pthread_t *)calloc(stages, sizeof(pthread_t));
+    for(i = 0; i < stages; ++i){
+        pipeline_stage *a = (pipeline_stage *)calloc(1, sizeof(pipeline_stage));
+        a->p = p;
+        a->stage = i;
+        p->pools[i] = make_thread_pool(threads);
+        if(pthread_create(p->threads + i, 0, pipeline_stage_thread, a)) error("Thread creation failed");
+    }
+    return p;
+}
+
+void free_network_pipeline(network_pipeline *p)
+{
+    int i;
+    pthread_mutex_lock(&p->mutex);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+    for(i = 0; i < p->stages; ++i){
+        pthread_join(p->threads[i], 0);
+        free_thread_pool(p->pools[i]);
+        free_replica(p->replicas[i]);
+    }
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->cond);
+    free(p->pools);
+    free(p->threads);
+    free(p->replicas);
+    free(p->done);
+    free(p->bounds);
+    free(p);
+}
+
+// Called with the mutex held
+static network *pipeline_next(network_pipeline *p)
+{
+    int slot = p->returned%p->stages;
+    while(p->done[slot] < p->stages) pthread_cond_wait(&p->cond, &p->mutex);
+    ++p->returned;
+    return p->replicas[slot];
+}
+
+// Starts a frame and, once the pipeline is full, returns the oldest one in
+// flight, stages - 1 frames back. Its layers hold the outputs until the
+// next call.
+network *pipeline_predict(network_pipeline *p, float *input)
+{
+    network *out = 0;
+    pthread_mutex_lock(&p->mutex);
+    int slot = p->submitted%p->stages;
+    pthread_mutex_unlock(&p->mutex);
+    network *r = p->replicas[slot];
+    memcpy(r->input, input, r->inputs*r->batch*sizeof(float));
+
+    pthread_mutex_lock(&p->mutex);
+    p->done[slot] = 0;
+    ++p->submitted;
+    pthread_cond_broadcast(&p->cond);
+    if(p->submitted - p->returned >= p->stages) out = pipeline_next(p);
+    pthread_mutex_unlock(&p->mutex);
+    return out;
+}
+
+// Returns the frames still in flight, oldest first, then 0
+network *pipeline_flush(network_pipeline *p)
+{
+    network *out = 0;
+    pthread_mutex_lock(&p->mutex);
+    if(p->returned < p->submitted) out = pipeline_next(p);
+    pthread_mutex_unlock(&p->mutex);
+    return out;
+}
@@ -0,0 +1,427 @@
+#include "quantize.h"
+#include "network.h"
+#include "utils.h"
+#include "thread_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*
+ * Symmetric INT8 inference. Weights get one scale per output channel and
+ * layer inputs one scale per tensor, both mapping max |x| to 127, so -128
+ * never occurs. Products are summed in int32 over KC-deep slices, which keeps
+ * every partial sum exact in float, and the epilogue dequantizes with
+ * weight_scale*input_scale per row.
+ *
+ * Packed A (weights) is MR-row panels over all of K, padded to a multiple of
+ * four; each group of four k holds MR rows of four bytes. Packed B is NR-column
+ * panels laid out the same way. The x86 kernels feed |b| as the unsigned and
+ * sign(a, b) as the signed operand of maddubs/dpbusd, which keeps the pair
+ * sums of maddubs below the int16 saturation limit.
+ */
+
+#define INT8_KC 1024
+#define INT8_NC 512
+#define INT8_ALIGN 64
+
+static int8_t *int8_buffer(int8_t **buf, size_t *size, size_t n)
+{
+    if(n > *size){
+        if(!*size) free_at_thread_exit((void **)buf);
+        free(*buf);
+        *buf = 0;
+        if(posix_memalign((void **)buf, INT8_ALIGN, n)) error("INT8 buffer allocation failed");
+        *size = n;
+    }
+    return *buf;
+}
+
+static int round_up(int x, int r)
+{
+    return (x + r - 1)/r*r;
+}
+
+static void gemm_int8_kernel_generic(int k4, const int8_t *a, const int8_t *b, float *c, int ldc)
+{
+    int32_t acc[INT8_MR*INT8_NR] = {0};
+    int p, i, j, t;
+    for(p = 0; p < k4; ++p){
+        for(i = 0; i < INT8_MR; ++i){
+            for(j = 0; j < INT8_NR; ++j){
+                int32_t sum = 0;
+                for(t = 0; t < 4; ++t) sum += a[i*4 + t]*b[j*4 + t];
+                acc[i*INT8_NR + j] += sum;
+            }
+        }
+        a += INT8_MR*4;
+        b += INT8_NR*4;
+    }
+    for(i = 0; i < INT8_MR; ++i){
+        for(j = 0; j < INT8_NR; ++j) c[i*ldc + j] += acc[i*INT8_NR + j];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+static inline int32_t load_int8x4(const int8_t *p)
+{
+    int32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+#define INT8_STORE_ROW(r, c0, c1) \
+    _mm256_storeu_ps(c + r*ldc,     _mm256_add_ps(_mm256_loadu_ps(c + r*ldc),     _mm256_cvtepi32_ps(c0))); \
+    _mm256_storeu_ps(c + r*ldc + 8, _mm256_add_ps(_mm256_loadu_ps(c + r*ldc + 8), _mm256_cvtepi32_ps(c1)))
+
+__attribute__((target("avx2")))
+static void gemm_int8_kernel_avx2(int k4, const int8_t *a, const int8_t *b, float *c, int ldc)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+    __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+    __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256();
+    __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256();
+    int p;
+    for(p = 0; p < k4; ++p){
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)b);
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(b + 32));
+        __m256i u0 = _mm256_abs_epi8(b0), u1 = _mm256_abs_epi8(b1);
+        __m256i ai;
+#define INT8_AVX2_ROW(r, c0, c1) \
+        ai = _mm256_set1_epi32(load_int8x4(a + 4*r)); \
+        c0 = _mm256_add_epi32(c0, _mm256_madd_epi16(_mm256_maddubs_epi16(u0, _mm256_sign_epi8(ai, b0)), ones)); \
+        c1 = _mm256_add_epi32(c1, _mm256_madd_epi16(_mm256_maddubs_epi16(u1, _mm256_sign_epi8(ai, b1)), ones))
+        INT8_AVX2_ROW(0, c00, c01);
+        INT8_AVX2_ROW(1, c10, c11);
+        INT8_AVX2_ROW(2, c20, c21);
+        INT8_AVX2_ROW(3, c30, c31);
+#undef INT8_AVX2_ROW
+        a += INT8_MR*4;
+        b += INT8_NR*4;
+    }
+    INT8_STORE_ROW(0, c00, c01);
+    INT8_STORE_ROW(1, c10, c11);
+    INT8_STORE_ROW(2, c20, c21);
+    INT8_STORE_ROW(3, c30, c31);
+}
+
+#define INT8_VNNI_KERNEL(name, isa, dpbusd) \
+__attribute__((target(isa))) \
+static void name(int k4, const int8_t *a, const int8_t *b, float *c, int ldc) \
+{ \
+    __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256(); \
+    __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256(); \
+    __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256(); \
+    __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256(); \
+    int p; \
+    for(p = 0; p < k4; ++p){ \
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)b); \
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(b + 32)); \
+        __m256i u0 = _mm256_abs_epi8(b0), u1 = _mm256_abs_epi8(b1); \
+        __m256i a0 = _mm256_set1_epi32(load_int8x4(a)); \
+        __m256i a1 = _mm256_set1_epi32(load_int8x4(a + 4)); \
+        __m256i a2 = _mm256_set1_epi32(load_int8x4(a + 8)); \
+        __m256i a3 = _mm256_set1_epi32(load_int8x4(a + 12)); \
+        c00 = dpbusd(c00, u0, _mm256_sign_epi8(a0, b0)); c01 = dpbusd(c01, u1, _mm256_sign_epi8(a0, b1)); \
+        c10 = dpbusd(c10, u0, _mm256_sign_epi8(a1, b0)); c11 = dpbusd(c11, u1, _mm256_sign_epi8(a1, b1)); \
+        c20 = dpbusd(c20, u0, _mm256_sign_epi8(a2, b0)); c21 = dpbusd(c21, u1, _mm256_sign_epi8(a2, b1)); \
+        c30 = dpbusd(c30, u0, _mm256_sign_epi8(a3, b0)); c31 = dpbusd(c31, u1, _mm256_sign_epi8(a3, b1)); \
+        a += INT8_MR*4; \
+        b += INT8_NR*4; \
+    } \
+    INT8_STORE_ROW(0, c00, c01); \
+    INT8_STORE_ROW(1, c10, c11); \
+    INT8_STORE_ROW(2, c20, c21); \
+    INT8_STORE_ROW(3, c30, c31); \
+}
+
+INT8_VNNI_KERNEL(gemm_int8_kernel_avx512vnni, "avx2,avx512vnni,avx512vl", _mm256_dpbusd_epi32)
+INT8_VNNI_KERNEL(gemm_int8_kernel_avxvnni, "avx2,avxvnni", _mm256_dpbusd_avx_epi32)
+#endif
+
+static const gemm_int8_kernel gemm_int8_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx512vnni", gemm_int8_kernel_avx512vnni},
+    {"avxvnni", gemm_int8_kernel_avxvnni},
+    {"avx2", gemm_int8_kernel_avx2},
+#endif
+    {"generic", gemm_int8_kernel_generic},
+};
+
+static int int8_kernel_supported(const gemm_int8_kernel *k)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(strcmp(k->name, "avx512vnni") == 0) return __builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl");
+    if(strcmp(k->name, "avxvnni") == 0) return __builtin_cpu_supports("avxvnni") && __builtin_cpu_supports("avx2");
+    if(strcmp(k->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+static const gemm_int8_kernel *select_gemm_int8_kernel()
+{
+    int n = sizeof(gemm_int8_kernels)/sizeof(gemm_int8_kernels[0]);
+    int i;
+    char *name = getenv("DARKNET_GEMM_INT8");
+    if(name){
+        for(i = 0; i < n; ++i){
+            if(strcmp(gemm_int8_kernels[i].name, name) != 0) continue;
+            if(int8_kernel_supported(gemm_int8_kernels + i)) return gemm_int8_kernels + i;
+            fprintf(stderr, "This CPU can't run INT8 GEMM kernel %s, picking automatically\n", name);
+            break;
+        }
+        if(i == n) fprintf(stderr, "Unknown INT8 GEMM kernel %s, picking automatically\n", name);
+    }
+    for(i = 0; i < n - 1; ++i){
+        if(int8_kernel_supported(gemm_int8_kernels + i)) return gemm_int8_kernels + i;
+    }
+    return gemm_int8_kernels + n - 1;
+}
+
+const gemm_int8_kernel *get_gemm_int8_kernel()
+{
+    static const gemm_int8_kernel *kernel = select_gemm_int8_kernel();
+    return kernel;
+}
+
+size_t int8_packed_size(int M, int K)
+{
+    return (size_t)round_up(M, INT8_MR)*round_up(K, 4);
+}
+
+void quantize_weights_int8(float *weights, int n, int k, float input_scale, int8_t *packed, float *scales)
+{
+    int K4 = round_up(k, 4);
+    int i, j;
+    memset(packed, 0, int8_packed_size(n, k));
+    for(i = 0; i < n; ++i){
+        float *w = weights + (size_t)i*k;
+        float max = 0;
+        for(j = 0; j < k; ++j) if(fabsf(w[j]) > max) max = fabsf(w[j]);
+        float scale = max > 0 ? max/127 : 1;
+        int8_t *panel = packed + (size_t)(i/INT8_MR)*INT8_MR*K4 + (i%INT8_MR)*4;
+        for(j = 0; j < k; ++j){
+            panel[(j/4)*INT8_MR*4 + j%4] = (int8_t)lrintf(w[j]/scale);
+        }
+        scales[i] = scale*input_scale;
+    }
+}
+
+void quantize_int8(float *x, int n, float scale, int8_t *q)
+{
+    float inv = 1/scale;
+    int i;
+    for(i = 0; i < n; ++i){
+        float v = x[i]*inv;
+        v = (v > 127) ? 127 : ((v < -127) ? -127 : v);
+        q[i] = (int8_t)lrintf(v);
+    }
+}
+
+void im2col_int8(int8_t *data_im, int channels, int height, int width, int ksize, int stride, int pad, int8_t *data_col)
+{
+    int c, h, w;
+    int height_col = (height + 2*pad - ksize) / stride + 1;
+    int width_col = (width + 2*pad - ksize) / stride + 1;
+    int channels_col = channels * ksize * ksize;
+    for(c = 0; c < channels_col; ++c){
+        int w_offset = c % ksize;
+        int h_offset = (c / ksize) % ksize;
+        int c_im = c / ksize / ksize;
+        int8_t *im = data_im + c_im*height*width;
+        for(h = 0; h < height_col; ++h){
+            int row = h_offset + h*stride - pad;
+            int8_t *col = data_col + (c*height_col + h)*width_col;
+            if(row < 0 || row >= height){
+                memset(col, 0, width_col);
+                continue;
+            }
+            for(w = 0; w < width_col; ++w){
+                int x = w_offset + w*stride - pad;
+                col[w] = (x >= 0 && x < width) ? im[row*width + x] : 0;
+            }
+        }
+    }
+}
+
+static void gemm_int8_pack_b(int8_t *B, int ldb, int K, int k0, int kc, int j0, int nc, int8_t *buf)
+{
+    int j, g, t, u;
+    for(j = 0; j < nc; j += INT8_NR){
+        int cols = (nc - j < INT8_NR) ? nc - j : INT8_NR;
+        int8_t *panel = buf + (size_t)j*kc;
+        for(g = 0; g < kc; g += 4){
+            int8_t *q = panel + g*INT8_NR;
+            for(t = 0; t < 4; ++t){
+                int k = k0 + g + t;
+                u = 0;
+                if(k < K){
+                    int8_t *row = B + (size_t)k*ldb + j0 + j;
+                    for(; u < cols; ++u) q[u*4 + t] = row[u];
+                }
+                for(; u < INT8_NR; ++u) q[u*4 + t] = 0;
+            }
+        }
+    }
+}
+
+typedef struct {
+    const gemm_int8_kernel *kern;
+    int M, K4, jc, ncb, pc, kcb;
+    int8_t *packed_a, *pb;
+    const gemm_epilogue *ep;
+    float *C;
+    int ldc;
+} gemm_int8_job;
+
+static void gemm_int8_panels(void *ptr, int begin, int end)
+{
+    gemm_int8_job *g = (gemm_int8_job *)ptr;
+    int M = g->M, K4 = g->K4, jc = g->jc, ncb = g->ncb, pc = g->pc, kcb = g->kcb, ldc = g->ldc;
+    int last = (pc + kcb == K4);
+    int ip;
+    for(ip = begin; ip < end; ++ip){
+        int i = ip*INT8_MR;
+        int rows = (M - i < INT8_MR) ? M - i : INT8_MR;
+        const int8_t *a = g->packed_a + (size_t)ip*INT8_MR*K4 + (size_t)pc*INT8_MR;
+        int j, t, u;
+        for(j = 0; j < ncb; j += INT8_NR){
+            int cols = (ncb - j < INT8_NR) ? ncb - j : INT8_NR;
+            float *c = g->C + i*ldc + jc + j;
+            if(rows == INT8_MR && cols == INT8_NR){
+                g->kern->kernel(kcb/4, a, g->pb + (size_t)j*kcb, c, ldc);
+            } else {
+                float tile[INT8_MR*INT8_NR] = {0};
+                g->kern->kernel(kcb/4, a, g->pb + (size_t)j*kcb, tile, INT8_NR);
+                for(t = 0; t < rows; ++t){
+                    for(u = 0; u < cols; ++u) c[t*ldc + u] += tile[t*INT8_NR + u];
+                }
+            }
+            if(last && g->ep) gemm_apply_epilogue(g->ep, i, rows, jc + j, cols, c, ldc);
+        }
+    }
+}
+
+void gemm_int8(int M, int N, int K, int8_t *packed_a, int8_t *B, int ldb,
+        const gemm_epilogue *ep, float *C, int ldc)
+{
+    static thread_local int8_t *pack_b = 0;
+    static thread_local size_t pack_b_size = 0;
+    int K4 = round_up(K, 4);
+    int panels = (M + INT8_MR - 1)/INT8_MR;
+    int jc, pc;
+    gemm_int8_job g = {get_gemm_int8_kernel(), M, K4};
+    g.packed_a = packed_a;
+    g.ep = ep;
+    g.C = C;
+    g.ldc = ldc;
+
+    for(jc = 0; jc < N; jc += INT8_NC){
+        int ncb = (N - jc < INT8_NC) ? N - jc : INT8_NC;
+        for(pc = 0; pc < K4; pc += INT8_KC){
+            int kcb = (K4 - pc < INT8_KC) ? K4 - pc : INT8_KC;
+            int8_t *pb = int8_buffer(&pack_b, &pack_b_size, (size_t)INT8_KC*INT8_NC);
+            gemm_int8_pack_b(B, ldb, K, pc, kcb, jc, ncb, pb);
+            g.jc = jc;
+            g.ncb = ncb;
+            g.pc = pc;
+            g.kcb = kcb;
+            g.pb = pb;
+            parallel_for(panels, 1, gemm_int8_panels, &g);
+        }
+    }
+}
+
+void convolution_int8(float *im, int c, int h, int w, int size, int stride, int pad, float input_scale,
+        int8_t *packed, int n, const gemm_epilogue *ep, float *out)
+{
+    static thread_local int8_t *q = 0, *col = 0;
+    static thread_local size_t q_size = 0, col_size = 0;
+    int out_h = (h + 2*pad - size)/stride + 1;
+    int out_w = (w + 2*pad - size)/stride + 1;
+    int k = c*size*size;
+    int m = out_h*out_w;
+
+    int8_t *b = int8_buffer(&q, &q_size, (size_t)c*h*w);
+    quantize_int8(im, c*h*w, input_scale, b);
+    if(size != 1 || stride != 1 || pad != 0){
+        int8_t *cols = int8_buffer(&col, &col_size, (size_t)k*m);
+        im2col_int8(b, c, h, w, size, stride, pad, cols);
+        b = cols;
+    }
+    memset(out, 0, (size_t)n*m*sizeof(float));
+    gemm_int8(n, m, k, packed, b, m, ep, out, m);
+}
+
+void calibrate_int8(network *net, float *input, float *ranges)
+{
+    network orig = *net;
+    int i, j;
+    net->input = input;
+    net->truth = 0;
+    net->train = 0;
+    net->delta = 0;
+    for(i = 0; i < net->n; ++i){
+        net->index = i;
+        layer l = net->layers[i];
+        if(l.type == CONVOLUTIONAL || l.type == CONNECTED){
+            int n = l.inputs*l.batch;
+            for(j = 0; j < n; ++j){
+                if(fabsf(net->input[j]) > ranges[i]) ranges[i] = fabsf(net->input[j]);
+            }
+        }
+        if(l.workspace_size && !net->workspace){
+            net->workspace = calloc(1, net->workspace_size);
+            orig.workspace = net->workspace;
+        }
+        l.forward(l, *net);
+        net->input = l.output;
+    }
+    *net = orig;
+}
+
+void save_int8_scales(network *net, float *ranges, char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    if(!fp) file_error(filename);
+    int i;
+    for(i = 0; i < net->n; ++i){
+        if(ranges[i] > 0) fprintf(fp, "%d %g\n", i, ranges[i]);
+    }
+    fclose(fp);
+}
+
+static int int8_layer(network *net, int i)
+{
+    layer l = net->layers[i];
+    if(i == 0) return 0;
+    if(i + 1 < net->n){
+        LAYER_TYPE next = net->layers[i + 1].type;
+        if(next == YOLO || next == REGION || next == DETECTION) return 0;
+    }
+    if(l.type == CONVOLUTIONAL) return l.groups == 1 && !l.binary && !l.xnor;
+    if(l.type == CONNECTED) return !l.batch_normalize;
+    return 0;
+}
+
+// The first layer and the heads feeding YOLO/region/detection layers stay in
+// fp32, they are cheap and carry most of the quantization error
+void load_int8_scales(network *net, char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if(!fp) file_error(filename);
+    int i, count = 0;
+    float range;
+    for(i = 0; i < net->n; ++i) net->layers[i].input_scale = 0;
+    while(fscanf(fp, "%d %f", &i, &range) == 2){
+        if(i < 0 || i >= net->n || range <= 0 || !int8_layer(net, i)) continue;
+        net->layers[i].input_scale = range/127;
+        ++count;
+    }
+    fclose(fp);
+    fprintf(stderr, "INT8: %d layers, %s kernel\n", count, get_gemm_int8_kernel()->name);
+}
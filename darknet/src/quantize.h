@@ -0,0 +1,29 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <stdint.h>
+#include "darknet.h"
+#include "gemm.h"
+
+#define INT8_MR 4
+#define INT8_NR 16
+
+typedef void (*gemm_int8_kernel_fn)(int k4, const int8_t *a, const int8_t *b, float *c, int ldc);
+
+typedef struct {
+    const char *name;
+    gemm_int8_kernel_fn kernel;
+} gemm_int8_kernel;
+
+const gemm_int8_kernel *get_gemm_int8_kernel();
+
+size_t int8_packed_size(int M, int K);
+void quantize_weights_int8(float *weights, int n, int k, float input_scale, int8_t *packed, float *scales);
+void quantize_int8(float *x, int n, float scale, int8_t *q);
+void im2col_int8(int8_t *data_im, int channels, int height, int width, int ksize, int stride, int pad, int8_t *data_col);
+void gemm_int8(int M, int N, int K, int8_t *packed_a, int8_t *B, int ldb,
+        const gemm_epilogue *ep, float *C, int ldc);
+void convolution_int8(float *im, int c, int h, int w, int size, int stride, int pad, float input_scale,
+        int8_t *packed, int n, const gemm_epilogue *ep, float *out);
+
+#endif
@@ -2,11 +2,12 @@
 #include "cuda.h"
 #include "blas.h"
 #include "activations.h"
+#include "thread_pool.h"
 
 #include <stdio.h>
 #include <assert.h>
 
-layer make_shortcut_layer(int batch, int index, int w, int h, int c, int w2, int h2, int c2)
+layer make_shortcut_layer(int batch, int index, int w, int h, int c, int w2, int h2, int c2, int train)
 {
     fprintf(stderr, "res  %3d                %4d x%4d x%4d   ->  %4d x%4d x%4d\n",index, w2,h2,c2, w,h,c);
     layer l = {0};
@@ -23,7 +24,7 @@ layer make_shortcut_layer(int batch, int index, int w, int h, int c, int w2, int
 
     l.index = index;
 
-    l.delta =  calloc(l.outputs*batch, sizeof(float));
+    if(train) l.delta =  calloc(l.outputs*batch, sizeof(float));
     l.output = calloc(l.outputs*batch, sizeof(float));;
 
     l.forward = forward_shortcut_layer;
@@ -46,7 +47,7 @@ void resize_shortcut_layer(layer *l, int w, int h)
     l->h = l->out_h = h;
     l->outputs = w*h*l->out_c;
     l->inputs = l->outputs;
-    l->delta =  realloc(l->delta, l->outputs*l->batch*sizeof(float));
+    if(l->delta) l->delta =  realloc(l->delta, l->outputs*l->batch*sizeof(float));
     l->output = realloc(l->output, l->outputs*l->batch*sizeof(float));
 
 #ifdef GPU
@@ -59,9 +60,33 @@ void resize_shortcut_layer(layer *l, int w, int h)
 }
 
 
+typedef struct {
+    const float *in, *add;
+    float alpha, beta;
+    ACTIVATION activation;
+    float *out;
+} shortcut_job;
+
+// Same shaped inputs add and activate in one pass, each chunk while it is
+// still in cache
+static void shortcut_range(void *ptr, int begin, int end)
+{
+    shortcut_job *j = (shortcut_job *)ptr;
+    int i;
+    for(i = begin; i < end; ++i) j->out[i] = j->alpha*j->in[i] + j->beta*j->add[i];
+    activate_span(j->out + begin, end - begin, j->activation);
+}
+
 void forward_shortcut_layer(const layer l, network net)
 {
-    copy_cpu(l.outputs*l.batch, net.input, 1, l.output, 1);
+    if(l.fused) return;
+    if(l.w == l.out_w && l.h == l.out_h && l.c == l.out_c){
+        shortcut_job j = {net.input, net.layers[l.index].output, l.alpha, l.beta, l.activation, l.output};
+        parallel_for(l.outputs*l.batch, 16384, shortcut_range, &j);
+        return;
+    }
+    // The previous layer may already write into our output, see optimize_network
+    if(net.input != l.output) copy_cpu(l.outputs*l.batch, net.input, 1, l.output, 1);
     shortcut_cpu(l.batch, l.w, l.h, l.c, net.layers[l.index].output, l.out_w, l.out_h, l.out_c, l.alpha, l.beta, l.output);
     activate_array(l.output, l.outputs*l.batch, l.activation);
 }
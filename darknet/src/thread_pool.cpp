@@ -0,0 +1,373 @@
+#include "thread_pool.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Work-stealing pool for data parallel loops. A loop is cut into fixed tiles
+ * of grain items and the tiles into one contiguous range per participant.
+ * Each participant, the calling thread included, drains its own range and
+ * then steals from the others, so a slow tile never idles the rest. Tiles
+ * only depend on n and grain, never on the thread count.
+ *
+ * Several threads may run loops on one pool at once: each caller works on
+ * its own loop and idle workers help whichever loops still have tiles. A
+ * loop started from inside a tile runs inline, so nesting never
+ * oversubscribes or deadlocks.
+ */
+
+#define POOL_MAX_SLOTS 64
+
+typedef struct {
+    int next;
+    int end;
+    char pad[56];
+} pool_slot;
+
+typedef struct parallel_job {
+    parallel_fn fn;
+    void *ctx;
+    int n, grain;
+    int slots;
+    pool_slot slot[POOL_MAX_SLOTS];
+    int pending;
+    int active;
+    int drained;
+    struct parallel_job *next;
+} parallel_job;
+
+struct thread_pool {
+    int threads;
+    pthread_t *workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    parallel_job *jobs;
+    int stop;
+};
+
+typedef struct {
+    thread_pool *pool;
+    int id;
+} pool_worker;
+
+static thread_local int in_parallel = 0;
+static thread_local thread_pool *current_pool = 0;
+
+static void run_job(parallel_job *job, int start)
+{
+    int s;
+    in_parallel = 1;
+    for(s = 0; s < job->slots; ++s){
+        pool_slot *slot = job->slot + (start + s)%job->slots;
+        int t;
+        while((t = __atomic_fetch_add(&slot->next, 1, __ATOMIC_RELAXED)) < slot->end){
+            int begin = t*job->grain;
+            int end = begin + job->grain < job->n ? begin + job->grain : job->n;
+            job->fn(job->ctx, begin, end);
+            __atomic_fetch_sub(&job->pending, 1, __ATOMIC_RELEASE);
+        }
+    }
+    in_parallel = 0;
+}
+
+static void *pool_worker_thread(void *ptr)
+{
+    pool_worker w = *(pool_worker *)ptr;
+    thread_pool *pool = w.pool;
+    free(ptr);
+    pthread_mutex_lock(&pool->mutex);
+    while(!pool->stop){
+        parallel_job *job = pool->jobs;
+        while(job && job->drained) job = job->next;
+        if(!job){
+            pthread_cond_wait(&pool->work, &pool->mutex);
+            continue;
+        }
+        ++job->active;
+        pthread_mutex_unlock(&pool->mutex);
+        run_job(job, w.id + 1);
+        pthread_mutex_lock(&pool->mutex);
+        job->drained = 1;
+        if(--job->active == 0) pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+thread_pool *make_thread_pool(int threads)
+{
+    thread_pool *pool = calloc(1, sizeof(thread_pool));
+    int i;
+    if(threads < 1) threads = 1;
+    pool->threads = threads - 1;
+    pthread_mutex_init(&pool->mutex, 0);
+    pthread_cond_init(&pool->work, 0);
+    pthread_cond_init(&pool->done, 0);
+    pool->workers = calloc(pool->threads, sizeof(pthread_t));
+    for(i = 0; i < pool->threads; ++i){
+        pool_worker *w = calloc(1, sizeof(pool_worker));
+        w->pool = pool;
+        w->id = i;
+        if(pthread_create(pool->workers + i, 0, pool_worker_thread, w)) error("Thread creation failed");
+    }
+    return pool;
+}
+
+void free_thread_pool(thread_pool *pool)
+{
+    int i;
+    if(!pool) return;
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+    for(i = 0; i < pool->threads; ++i) pthread_join(pool->workers[i], 0);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->workers);
+    free(pool);
+}
+
+int thread_pool_threads(thread_pool *pool)
+{
+    return pool->threads + 1;
+}
+
+void thread_pool_for(thread_pool *pool, int n, int grain, parallel_fn fn, void *ctx)
+{
+    if(n <= 0) return;
+    if(grain < 1) grain = 1;
+    int tiles = (n + grain - 1)/grain;
+    if(in_parallel || !pool || !pool->threads || tiles == 1){
+        fn(ctx, 0, n);
+        return;
+    }
+
+    parallel_job job;
+    int s;
+    job.fn = fn;
+    job.ctx = ctx;
+    job.n = n;
+    job.grain = grain;
+    job.slots = pool->threads + 1;
+    if(job.slots > tiles) job.slots = tiles;
+    if(job.slots > POOL_MAX_SLOTS) job.slots = POOL_MAX_SLOTS;
+    for(s = 0; s < job.slots; ++s){
+        job.slot[s].next = (int)((long)tiles*s/job.slots);
+        job.slot[s].end = (int)((long)tiles*(s + 1)/job.slots);
+    }
+    job.pending = tiles;
+    job.active = 0;
+    job.drained = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    job.next = pool->jobs;
+    pool->jobs = &job;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+
+    run_job(&job, 0);
+
+    pthread_mutex_lock(&pool->mutex);
+    job.drained = 1;
+    while(job.active || __atomic_load_n(&job.pending, __ATOMIC_ACQUIRE)){
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    parallel_job **p = &pool->jobs;
+    while(*p != &job) p = &(*p)->next;
+    *p = job.next;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static pthread_mutex_t global_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static thread_pool *global_pool = 0;
+static int global_pool_threads = 0;
+
+static int default_threads()
+{
+    char *env = getenv("DARKNET_THREADS");
+    if(env && atoi(env) > 0) return atoi(env);
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+// Resizes the process-wide pool; 0 picks DARKNET_THREADS or the online CPU
+// count. Call it while no network is running.
+void set_thread_pool_threads(int threads)
+{
+    if(threads <= 0) threads = default_threads();
+    pthread_mutex_lock(&global_pool_mutex);
+    if(global_pool && thread_pool_threads(global_pool) != threads){
+        free_thread_pool(global_pool);
+        global_pool = 0;
+    }
+    global_pool_threads = threads;
+    pthread_mutex_unlock(&global_pool_mutex);
+}
+
+thread_pool *get_thread_pool()
+{
+    pthread_mutex_lock(&global_pool_mutex);
+    if(!global_pool){
+        if(!global_pool_threads) global_pool_threads = default_threads();
+        global_pool = make_thread_pool(global_pool_threads);
+    }
+    thread_pool *pool = global_pool;
+    pthread_mutex_unlock(&global_pool_mutex);
+    return pool;
+}
+
+// Makes pool the one this thread's parallel loops run on, 0 meaning the
+// process-wide pool, and returns the previous one
+thread_pool *swap_thread_pool(thread_pool *pool)
+{
+    thread_pool *old = current_pool;
+    current_pool = pool;
+    return old;
+}
+
+int parallel_threads()
+{
+    if(in_parallel) return 1;
+    return thread_pool_threads(current_pool ? current_pool : get_thread_pool());
+}
+
+void parallel_for(int n, int grain, parallel_fn fn, void *ctx)
+{
+    thread_pool_for(current_pool ? current_pool : get_thread_pool(), n, grain, fn, ctx);
+}
+
+/*
+ * Task threads run whole independent jobs side by side, each of which can
+ * start its own parallel loops on the caller's pool. They are kept on an
+ * idle list once created, as the scratch buffers their loops cache per
+ * thread would leak with every short lived thread.
+ */
+
+typedef struct task_thread {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    parallel_fn fn;
+    void *ctx;
+    int index;
+    thread_pool *pool;
+    int busy;
+    struct task_thread *next;
+} task_thread;
+
+static pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
+static task_thread *idle_tasks = 0;
+
+static void *task_thread_main(void *ptr)
+{
+    task_thread *t = (task_thread *)ptr;
+    pthread_mutex_lock(&t->mutex);
+    while(1){
+        while(!t->busy) pthread_cond_wait(&t->cond, &t->mutex);
+        pthread_mutex_unlock(&t->mutex);
+        current_pool = t->pool;
+        t->fn(t->ctx, t->index, t->index + 1);
+        pthread_mutex_lock(&t->mutex);
+        t->busy = 0;
+        pthread_cond_signal(&t->cond);
+    }
+    return 0;
+}
+
+static task_thread *get_task_thread()
+{
+    pthread_mutex_lock(&task_mutex);
+    task_thread *t = idle_tasks;
+    if(t) idle_tasks = t->next;
+    pthread_mutex_unlock(&task_mutex);
+    if(t) return t;
+
+    t = calloc(1, sizeof(task_thread));
+    pthread_mutex_init(&t->mutex, 0);
+    pthread_cond_init(&t->cond, 0);
+    if(pthread_create(&t->thread, 0, task_thread_main, t)) error("Thread creation failed");
+    pthread_detach(t->thread);
+    return t;
+}
+
+// Runs tasks [0, n) of fn at once, each on its own thread
+void parallel_tasks(int n, parallel_fn fn, void *ctx)
+{
+    task_thread *tasks[POOL_MAX_SLOTS];
+    int i;
+    if(n <= 0) return;
+    if(in_parallel || n == 1 || n > POOL_MAX_SLOTS){
+        fn(ctx, 0, n);
+        return;
+    }
+    for(i = 1; i < n; ++i){
+        task_thread *t = get_task_thread();
+        pthread_mutex_lock(&t->mutex);
+        t->fn = fn;
+        t->ctx = ctx;
+        t->index = i;
+        t->pool = current_pool;
+        t->busy = 1;
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->mutex);
+        tasks[i] = t;
+    }
+    fn(ctx, 0, 1);
+    for(i = 1; i < n; ++i){
+        task_thread *t = tasks[i];
+        pthread_mutex_lock(&t->mutex);
+        while(t->busy) pthread_cond_wait(&t->cond, &t->mutex);
+        pthread_mutex_unlock(&t->mutex);
+        pthread_mutex_lock(&task_mutex);
+        t->next = idle_tasks;
+        idle_tasks = t;
+        pthread_mutex_unlock(&task_mutex);
+    }
+}
+
+/*
+ * Kernels cache their packing scratch in thread_local pointers. Those are
+ * registered here the first time they grow, so the scratch goes away with
+ * the thread rather than leaking each time a pool or pipeline is freed.
+ */
+
+typedef struct thread_scratch {
+    void **buf;
+    struct thread_scratch *next;
+} thread_scratch;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void free_thread_scratch(void *ptr)
+{
+    thread_scratch *s = (thread_scratch *)ptr;
+    while(s){
+        thread_scratch *next = s->next;
+        free(*s->buf);
+        *s->buf = 0;
+        free(s);
+        s = next;
+    }
+}
+
+static void make_scratch_key()
+{
+    pthread_key_create(&scratch_key, free_thread_scratch);
+}
+
+// Frees *buf, a thread_local of the calling thread, when that thread exits
+void free_at_thread_exit(void **buf)
+{
+    pthread_once(&scratch_once, make_scratch_key);
+    thread_scratch *s = (thread_scratch *)calloc(1, sizeof(thread_scratch));
+    s->buf = buf;
+    s->next = (thread_scratch *)pthread_getspecific(scratch_key);
+    pthread_setspecific(scratch_key, s);
+}
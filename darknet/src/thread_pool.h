@@ -0,0 +1,23 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "darknet.h"
+
+// Runs items [begin, end) of a parallel loop
+typedef void (*parallel_fn)(void *ctx, int begin, int end);
+
+typedef struct thread_pool thread_pool;
+
+thread_pool *make_thread_pool(int threads);
+void free_thread_pool(thread_pool *pool);
+int thread_pool_threads(thread_pool *pool);
+void thread_pool_for(thread_pool *pool, int n, int grain, parallel_fn fn, void *ctx);
+
+thread_pool *get_thread_pool();
+thread_pool *swap_thread_pool(thread_pool *pool);
+int parallel_threads();
+void parallel_for(int n, int grain, parallel_fn fn, void *ctx);
+void parallel_tasks(int n, parallel_fn fn, void *ctx);
+void free_at_thread_exit(void **buf);
+
+#endif
@@ -0,0 +1,133 @@
+#include "tuner.h"
+#include "convolutional_layer.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * conv_algo=tune times every algorithm a conv layer can run on its first
+ * load and keeps the fastest. When [net] tune_cache names a file, winners
+ * are appended to it as "key algo" lines, the key naming the CPU model, the
+ * layer shape and the net options that change which kernels run, so a
+ * cache can be shared between cfgs and machines without mixing up results.
+ * Without one every load tunes again.
+ */
+
+#define TUNE_RUNS 3
+
+static const char *tune_algo_names[] = {"gemm", "im2col", "winograd", "depthwise"};
+
+static void cpu_model(char *buf, size_t n)
+{
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+    char *line;
+    snprintf(buf, n, "unknown");
+    if(!fp) return;
+    while((line = fgetl(fp))){
+        char *colon = strchr(line, ':');
+        if(!strncmp(line, "model name", 10) && colon){
+            snprintf(buf, n, "%s", colon + 1);
+            free(line);
+            break;
+        }
+        free(line);
+    }
+    fclose(fp);
+    strip(buf);
+}
+
+static void tune_key(layer *l, network *net, char *buf, size_t n)
+{
+    static char cpu[256] = {0};
+    if(!cpu[0]) cpu_model(cpu, sizeof(cpu));
+    snprintf(buf, n, "%s/%dx%dx%dx%d/%d/%dx%d/s%d/p%d/g%d/w%d/pk%d", cpu,
+            l->batch, l->c, l->h, l->w, l->n, l->size, l->size, l->stride, l->pad, l->groups,
+            l->weight_format, net->prepack);
+}
+
+static int read_tune_cache(char *filename, char *key, CONV_ALGO *algo)
+{
+    FILE *fp = fopen(filename, "r");
+    char *line;
+    int found = 0;
+    if(!fp) return 0;
+    while((line = fgetl(fp))){
+        char *space = strrchr(line, ' ');
+        if(space){
+            *space = 0;
+            if(!strcmp(line, key)){
+                int i;
+                for(i = 0; i < 4; ++i){
+                    if(!strcmp(space + 1, tune_algo_names[i])){
+                        *algo = (CONV_ALGO)i;
+                        found = 1;
+                    }
+                }
+            }
+        }
+        free(line);
+    }
+    fclose(fp);
+    return found;
+}
+
+static double time_convolutional_layer(layer *l, network net)
+{
+    double best = 0;
+    int i;
+    l->forward(*l, net);
+    for(i = 0; i < TUNE_RUNS; ++i){
+        double start = what_time_is_it_now();
+        l->forward(*l, net);
+        double t = what_time_is_it_now() - start;
+        if(i == 0 || t < best) best = t;
+    }
+    return best;
+}
+
+CONV_ALGO tune_convolutional_layer(layer *l, network *net)
+{
+    char key[512];
+    CONV_ALGO best = CONV_AUTO;
+    double best_time = 0;
+    int i;
+
+    // INT8 and XNOR layers ignore the algorithm
+    if(net->train || l->input_scale > 0 || l->xnor) return CONV_AUTO;
+    tune_key(l, net, key, sizeof(key));
+    if(net->tune_cache && read_tune_cache(net->tune_cache, key, &best)) return best;
+
+    network tmp = *net;
+    tmp.train = 0;
+    tmp.input = calloc(l->inputs*l->batch, sizeof(float));
+    tmp.workspace = l->workspace_size ? (float *)calloc(1, l->workspace_size) : 0;
+    for(i = 0; i < l->inputs*l->batch; ++i) tmp.input[i] = rand_uniform(-1, 1);
+
+    fprintf(stderr, "tuning conv %2dx%2d/%d %4d -> %4d %4dx%4d:", l->size, l->size, l->stride, l->c, l->n, l->out_w, l->out_h);
+    for(i = 0; i < 4; ++i){
+        CONV_ALGO algo = (CONV_ALGO)i;
+        if(algo == CONV_IM2COL && l->size == 1 && l->stride == 1 && l->pad == 0) continue;
+        prepare_convolutional_layer(l, net, algo);
+        if(l->algo != algo) continue;
+        double t = time_convolutional_layer(l, tmp);
+        fprintf(stderr, " %s %.2fms", tune_algo_names[i], t*1000);
+        if(best == CONV_AUTO || t < best_time){
+            best = algo;
+            best_time = t;
+        }
+    }
+    fprintf(stderr, " -> %s\n", tune_algo_names[best]);
+    free(tmp.input);
+    free(tmp.workspace);
+
+    if(!net->tune_cache) return best;
+    FILE *fp = fopen(net->tune_cache, "a");
+    if(fp){
+        fprintf(fp, "%s %s\n", key, tune_algo_names[best]);
+        fclose(fp);
+    } else {
+        fprintf(stderr, "Couldn't write tuning cache %s\n", net->tune_cache);
+    }
+    return best;
+}
@@ -0,0 +1,8 @@
+#ifndef TUNER_H
+#define TUNER_H
+
+#include "darknet.h"
+
+CONV_ALGO tune_convolutional_layer(layer *l, network *net);
+
+#endif
@@ -0,0 +1,208 @@
+#include "winograd.h"
+#include "gemm.h"
+#include "utils.h"
+#include "thread_pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Winograd F(4x4, 3x3), Lavin & Gray. Each 6x6 input tile d and 3x3 filter
+ * g give a 4x4 output tile Y = A^T [(G g G^T) .* (B^T d B)] A, which turns
+ * the 144 multiplies of a direct 4x4x3x3 tile into 36. The 36 elementwise
+ * products are summed over input channels as 36 independent GEMMs.
+ */
+
+#define WINOGRAD_TILE 4
+
+static float *winograd_buffer(float **buf, size_t *size, size_t n)
+{
+    if(n > *size){
+        if(!*size) free_at_thread_exit((void **)buf);
+        free(*buf);
+        *buf = (float*)malloc(n*sizeof(float));
+        if(!*buf) malloc_error();
+        *size = n;
+    }
+    return *buf;
+}
+
+void winograd_transform_weights(float *weights, int n, int c, float *transformed)
+{
+    static const float G[6][3] = {
+        { 1./4,      0,     0},
+        {-1./6,  -1./6, -1./6},
+        {-1./6,   1./6, -1./6},
+        { 1./24,  1./12, 1./6},
+        { 1./24, -1./12, 1./6},
+        {     0,      0,     1}
+    };
+    int f, ch, i, j, k;
+    for(f = 0; f < n; ++f){
+        for(ch = 0; ch < c; ++ch){
+            float *g = weights + (f*c + ch)*9;
+            float tmp[6][3];
+            for(i = 0; i < 6; ++i){
+                for(j = 0; j < 3; ++j){
+                    tmp[i][j] = G[i][0]*g[0*3 + j] + G[i][1]*g[1*3 + j] + G[i][2]*g[2*3 + j];
+                }
+            }
+            for(i = 0; i < 6; ++i){
+                for(j = 0; j < 6; ++j){
+                    float u = 0;
+                    for(k = 0; k < 3; ++k) u += tmp[i][k]*G[j][k];
+                    transformed[((i*6 + j)*n + f)*c + ch] = u;
+                }
+            }
+        }
+    }
+}
+
+static inline void winograd_input_1d(const float *d, int stride, float *t, int tstride)
+{
+    float d0 = d[0], d1 = d[stride], d2 = d[2*stride], d3 = d[3*stride], d4 = d[4*stride], d5 = d[5*stride];
+    t[0]         = 4*d0 - 5*d2 + d4;
+    t[tstride]   = -4*(d1 + d2) + d3 + d4;
+    t[2*tstride] = 4*(d1 - d2) - d3 + d4;
+    t[3*tstride] = 2*(d3 - d1) - d2 + d4;
+    t[4*tstride] = 2*(d1 - d3) - d2 + d4;
+    t[5*tstride] = 4*d1 - 5*d3 + d5;
+}
+
+static inline void winograd_output_1d(const float *m, int stride, float *o, int ostride)
+{
+    float m0 = m[0], m1 = m[stride], m2 = m[2*stride], m3 = m[3*stride], m4 = m[4*stride], m5 = m[5*stride];
+    float a = m1 + m2, b = m1 - m2, p = m3 + m4, q = m3 - m4;
+    o[0]         = m0 + a + p;
+    o[ostride]   = b + 2*q;
+    o[2*ostride] = a + 4*p;
+    o[3*ostride] = b + 8*q + m5;
+}
+
+typedef struct {
+    float *im;
+    int c, h, w, pad, tiles_w, t0, tn;
+    float *V;
+} winograd_input_job;
+
+static void winograd_input_channels(void *ptr, int begin, int end)
+{
+    winograd_input_job *j = (winograd_input_job *)ptr;
+    int c = j->c, h = j->h, w = j->w, tn = j->tn;
+    int ch, t;
+    for(ch = begin; ch < end; ++ch){
+        float *chan = j->im + ch*h*w;
+        for(t = 0; t < tn; ++t){
+            float d[36], tmp[36];
+            int y0 = ((j->t0 + t)/j->tiles_w)*WINOGRAD_TILE - j->pad;
+            int x0 = ((j->t0 + t)%j->tiles_w)*WINOGRAD_TILE - j->pad;
+            int i, k;
+            if(y0 >= 0 && x0 >= 0 && y0 + 6 <= h && x0 + 6 <= w){
+                for(i = 0; i < 6; ++i) memcpy(d + i*6, chan + (y0 + i)*w + x0, 6*sizeof(float));
+            } else {
+                for(i = 0; i < 6; ++i){
+                    int y = y0 + i;
+                    for(k = 0; k < 6; ++k){
+                        int x = x0 + k;
+                        d[i*6 + k] = (y >= 0 && y < h && x >= 0 && x < w) ? chan[y*w + x] : 0;
+                    }
+                }
+            }
+            for(k = 0; k < 6; ++k) winograd_input_1d(d + k, 6, tmp + k, 6);
+            for(i = 0; i < 6; ++i) winograd_input_1d(tmp + i*6, 1, d + i*6, 1);
+            for(i = 0; i < 36; ++i) j->V[(i*c + ch)*tn + t] = d[i];
+        }
+    }
+}
+
+static void winograd_input_transform(float *im, int c, int h, int w, int pad,
+        int tiles_w, int t0, int tn, float *V)
+{
+    winograd_input_job j = {im, c, h, w, pad, tiles_w, t0, tn, V};
+    parallel_for(c, 1, winograd_input_channels, &j);
+}
+
+typedef struct {
+    float *M;
+    int n, tn, t0, tiles_w;
+    const gemm_epilogue *ep;
+    float *out;
+    int out_h, out_w;
+} winograd_output_job;
+
+static void winograd_output_filters(void *ptr, int begin, int end)
+{
+    winograd_output_job *k = (winograd_output_job *)ptr;
+    int n = k->n, tn = k->tn, out_h = k->out_h, out_w = k->out_w;
+    int f, t;
+    for(f = begin; f < end; ++f){
+        float *chan = k->out + f*out_h*out_w;
+        for(t = 0; t < tn; ++t){
+            float m[36], tmp[24], y[16];
+            int i, j;
+            for(i = 0; i < 36; ++i) m[i] = k->M[(i*n + f)*tn + t];
+            for(j = 0; j < 6; ++j) winograd_output_1d(m + j, 6, tmp + j, 6);
+            for(i = 0; i < 4; ++i) winograd_output_1d(tmp + i*6, 1, y + i*4, 1);
+            int oy = ((k->t0 + t)/k->tiles_w)*WINOGRAD_TILE;
+            int ox = ((k->t0 + t)%k->tiles_w)*WINOGRAD_TILE;
+            int rows = (out_h - oy < 4) ? out_h - oy : 4;
+            int cols = (out_w - ox < 4) ? out_w - ox : 4;
+            for(i = 0; i < rows; ++i){
+                float *o = chan + (oy + i)*out_w + ox;
+                for(j = 0; j < cols; ++j) o[j] = y[i*4 + j];
+                if(k->ep) gemm_apply_epilogue(k->ep, f, 1, (oy + i)*out_w + ox, cols, o, out_h*out_w);
+            }
+        }
+    }
+}
+
+static void winograd_output_transform(float *M, int n, int tn, int t0, int tiles_w,
+        const gemm_epilogue *ep, float *out, int out_h, int out_w)
+{
+    winograd_output_job k = {M, n, tn, t0, tiles_w, ep, out, out_h, out_w};
+    parallel_for(n, 1, winograd_output_filters, &k);
+}
+
+static void winograd_convolution_blocked(float *im, int c, int h, int w, int pad,
+        float *U, int packed, int n, const gemm_epilogue *ep, float *out)
+{
+    static thread_local float *V = 0, *M = 0;
+    static thread_local size_t V_size = 0, M_size = 0;
+    int out_h = h + 2*pad - 2;
+    int out_w = w + 2*pad - 2;
+    int tiles_w = (out_w + WINOGRAD_TILE - 1)/WINOGRAD_TILE;
+    int tiles_h = (out_h + WINOGRAD_TILE - 1)/WINOGRAD_TILE;
+    int tiles = tiles_w*tiles_h;
+
+    // Aim for ~4MB of transformed tiles per block, but never fewer than 96
+    // tiles or re-packing the 36 weight matrices dominates on deep layers
+    int block = (1 << 20)/(36*(c + n));
+    block = (block/16)*16;
+    if(block < 96) block = 96;
+    if(block > tiles) block = tiles;
+
+    float *v = winograd_buffer(&V, &V_size, (size_t)36*c*block);
+    float *m = winograd_buffer(&M, &M_size, (size_t)36*n*block);
+    int t0, i;
+    for(t0 = 0; t0 < tiles; t0 += block){
+        int tn = (tiles - t0 < block) ? tiles - t0 : block;
+        winograd_input_transform(im, c, h, w, pad, tiles_w, t0, tn, v);
+        memset(m, 0, (size_t)36*n*tn*sizeof(float));
+        for(i = 0; i < 36; ++i){
+            if(packed) gemm_cpu_packed_a(n, tn, c, U + i*gemm_packed_a_size(n, c), 0, v + (size_t)i*c*tn, tn, 0, m + (size_t)i*n*tn, tn);
+            else gemm_cpu(0, 0, n, tn, c, 1, U + (size_t)i*n*c, c, v + (size_t)i*c*tn, tn, 1, m + (size_t)i*n*tn, tn);
+        }
+        winograd_output_transform(m, n, tn, t0, tiles_w, ep, out, out_h, out_w);
+    }
+}
+
+void winograd_convolution(float *im, int c, int h, int w, int pad,
+        float *U, int n, const gemm_epilogue *ep, float *out)
+{
+    winograd_convolution_blocked(im, c, h, w, pad, U, 0, n, ep, out);
+}
+
+void winograd_convolution_packed(float *im, int c, int h, int w, int pad,
+        float *U, int n, const gemm_epilogue *ep, float *out)
+{
+    winograd_convolution_blocked(im, c, h, w, pad, U, 1, n, ep, out);
+}
@@ -0,0 +1,12 @@
+#ifndef WINOGRAD_H
+#define WINOGRAD_H
+
+#include "gemm.h"
+
+void winograd_transform_weights(float *weights, int n, int c, float *transformed);
+void winograd_convolution(float *im, int c, int h, int w, int pad,
+        float *U, int n, const gemm_epilogue *ep, float *out);
+void winograd_convolution_packed(float *im, int c, int h, int w, int pad,
+        float *U, int n, const gemm_epilogue *ep, float *out);
+
+#endif
@@ -0,0 +1,302 @@
+#include "xnor.h"
+#include "utils.h"
+#include "thread_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*
+ * Bit-packed XNOR convolution. A weight or input bit is set when the value
+ * is positive, matching binarize_weights/binarize_cpu. Bits are ordered by
+ * kernel tap and then channel, each tap padded to whole 64-bit words, so a
+ * column of the input is a copy of per-pixel channel words; rows and columns
+ * are padded to a multiple of four words. Zero padding of the input
+ * contributes nothing to the float product, so each column also carries a
+ * mask of its in-bounds taps:
+ *
+ *   sum(sign(w)*sign(x)) = valid - 2*popcount((w ^ x) & mask)
+ *
+ * which is then scaled by the mean |w| of each filter in the epilogue.
+ */
+
+#define XNOR_ALIGN 64
+
+static void *xnor_buffer(void **buf, size_t *size, size_t n)
+{
+    if(n > *size){
+        if(!*size) free_at_thread_exit(buf);
+        free(*buf);
+        *buf = 0;
+        if(posix_memalign(buf, XNOR_ALIGN, n)) error("XNOR buffer allocation failed");
+        *size = n;
+    }
+    return *buf;
+}
+
+static int round_up(int x, int r)
+{
+    return (x + r - 1)/r*r;
+}
+
+#define XNOR_SCALAR_KERNEL(name, attr) \
+attr \
+static void name(int w, const uint64_t *a, const uint64_t *b, const uint64_t *m, int *pop) \
+{ \
+    int i, j, p; \
+    for(i = 0; i < XNOR_MR; ++i){ \
+        for(j = 0; j < XNOR_NR; ++j){ \
+            const uint64_t *ai = a + i*w, *bj = b + j*w, *mj = m + j*w; \
+            int sum = 0; \
+            for(p = 0; p < w; ++p) sum += __builtin_popcountll((ai[p] ^ bj[p]) & mj[p]); \
+            pop[i*XNOR_NR + j] = sum; \
+        } \
+    } \
+}
+
+XNOR_SCALAR_KERNEL(gemm_xnor_kernel_generic, )
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+XNOR_SCALAR_KERNEL(gemm_xnor_kernel_popcnt, __attribute__((target("popcnt"))))
+
+__attribute__((target("avx2")))
+static inline int hsum_epi64(__m256i v)
+{
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return (int)(_mm_cvtsi128_si64(s) + _mm_extract_epi64(s, 1));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i popcount_epi64_avx2(__m256i v)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low));
+    __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+#define XNOR_VECTOR_KERNEL(name, isa, popcount) \
+__attribute__((target(isa))) \
+static void name(int w, const uint64_t *a, const uint64_t *b, const uint64_t *m, int *pop) \
+{ \
+    __m256i c0[XNOR_NR], c1[XNOR_NR]; \
+    int j, p; \
+    for(j = 0; j < XNOR_NR; ++j) c0[j] = c1[j] = _mm256_setzero_si256(); \
+    for(p = 0; p < w; p += 4){ \
+        __m256i a0 = _mm256_load_si256((const __m256i *)(a + p)); \
+        __m256i a1 = _mm256_load_si256((const __m256i *)(a + w + p)); \
+        for(j = 0; j < XNOR_NR; ++j){ \
+            __m256i bj = _mm256_load_si256((const __m256i *)(b + j*w + p)); \
+            __m256i mj = _mm256_load_si256((const __m256i *)(m + j*w + p)); \
+            c0[j] = _mm256_add_epi64(c0[j], popcount(_mm256_and_si256(_mm256_xor_si256(a0, bj), mj))); \
+            c1[j] = _mm256_add_epi64(c1[j], popcount(_mm256_and_si256(_mm256_xor_si256(a1, bj), mj))); \
+        } \
+    } \
+    for(j = 0; j < XNOR_NR; ++j){ \
+        pop[j] = hsum_epi64(c0[j]); \
+        pop[XNOR_NR + j] = hsum_epi64(c1[j]); \
+    } \
+}
+
+XNOR_VECTOR_KERNEL(gemm_xnor_kernel_avx2, "avx2", popcount_epi64_avx2)
+XNOR_VECTOR_KERNEL(gemm_xnor_kernel_avx512, "avx2,avx512vpopcntdq,avx512vl", _mm256_popcnt_epi64)
+#endif
+
+static const gemm_xnor_kernel gemm_xnor_kernels[] = {
+#ifdef __x86_64__
+    {"avx512vpopcntdq", gemm_xnor_kernel_avx512},
+    {"avx2", gemm_xnor_kernel_avx2},
+    {"popcnt", gemm_xnor_kernel_popcnt},
+#endif
+    {"generic", gemm_xnor_kernel_generic},
+};
+
+static int xnor_kernel_supported(const gemm_xnor_kernel *k)
+{
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if(strcmp(k->name, "avx512vpopcntdq") == 0) return __builtin_cpu_supports("avx512vpopcntdq") && __builtin_cpu_supports("avx512vl");
+    if(strcmp(k->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if(strcmp(k->name, "popcnt") == 0) return __builtin_cpu_supports("popcnt");
+#endif
+    return 1;
+}
+
+static const gemm_xnor_kernel *select_gemm_xnor_kernel()
+{
+    int n = sizeof(gemm_xnor_kernels)/sizeof(gemm_xnor_kernels[0]);
+    int i;
+    char *name = getenv("DARKNET_GEMM_XNOR");
+    if(name){
+        for(i = 0; i < n; ++i){
+            if(strcmp(gemm_xnor_kernels[i].name, name) != 0) continue;
+            if(xnor_kernel_supported(gemm_xnor_kernels + i)) return gemm_xnor_kernels + i;
+            fprintf(stderr, "This CPU can't run XNOR GEMM kernel %s, picking automatically\n", name);
+            break;
+        }
+        if(i == n) fprintf(stderr, "Unknown XNOR GEMM kernel %s, picking automatically\n", name);
+    }
+    for(i = 0; i < n - 1; ++i){
+        if(xnor_kernel_supported(gemm_xnor_kernels + i)) return gemm_xnor_kernels + i;
+    }
+    return gemm_xnor_kernels + n - 1;
+}
+
+const gemm_xnor_kernel *get_gemm_xnor_kernel()
+{
+    static const gemm_xnor_kernel *kernel = select_gemm_xnor_kernel();
+    return kernel;
+}
+
+int xnor_words(int c, int size)
+{
+    return round_up(size*size*((c + 63)/64), 4);
+}
+
+size_t xnor_packed_size(int M, int c, int size)
+{
+    return (size_t)round_up(M, XNOR_MR)*xnor_words(c, size);
+}
+
+uint64_t *xnor_packed_alloc(size_t n)
+{
+    uint64_t *p = 0;
+    if(posix_memalign((void **)&p, XNOR_ALIGN, n*sizeof(uint64_t))) malloc_error();
+    memset(p, 0, n*sizeof(uint64_t));
+    return p;
+}
+
+void binarize_weights_xnor(float *weights, int n, int c, int size, uint64_t *packed, float *scales)
+{
+    int k = c*size*size;
+    int cw = (c + 63)/64;
+    int w = xnor_words(c, size);
+    int i, j, t;
+    memset(packed, 0, xnor_packed_size(n, c, size)*sizeof(uint64_t));
+    for(i = 0; i < n; ++i){
+        float *f = weights + (size_t)i*k;
+        uint64_t *row = packed + (size_t)i*w;
+        float mean = 0;
+        for(j = 0; j < c; ++j){
+            for(t = 0; t < size*size; ++t){
+                float v = f[j*size*size + t];
+                mean += fabs(v);
+                if(v > 0) row[t*cw + (j >> 6)] |= (uint64_t)1 << (j & 63);
+            }
+        }
+        scales[i] = mean/k;
+    }
+}
+
+void im2col_xnor(float *data_im, int channels, int height, int width, int ksize, int stride, int pad,
+        uint64_t *bits, uint64_t *mask, int *valid)
+{
+    static thread_local void *image = 0;
+    static thread_local size_t image_size = 0;
+    int height_col = (height + 2*pad - ksize) / stride + 1;
+    int width_col = (width + 2*pad - ksize) / stride + 1;
+    int cw = (channels + 63)/64;
+    int w = xnor_words(channels, ksize);
+    int hw = height*width;
+    int c, i, y, x, ky, kx;
+
+    // Channel bits of every pixel, so each kernel tap is cw whole words
+    uint64_t *im = (uint64_t *)xnor_buffer(&image, &image_size, (size_t)hw*cw*sizeof(uint64_t));
+    memset(im, 0, (size_t)hw*cw*sizeof(uint64_t));
+    for(c = 0; c < channels; ++c){
+        float *src = data_im + (size_t)c*hw;
+        uint64_t *dst = im + (c >> 6);
+        int shift = c & 63;
+        for(i = 0; i < hw; ++i) dst[i*cw] |= (uint64_t)(src[i] > 0) << shift;
+    }
+
+    for(y = 0; y < height_col; ++y){
+        for(x = 0; x < width_col; ++x){
+            int j = y*width_col + x;
+            uint64_t *b = bits + (size_t)j*w;
+            uint64_t *m = mask + (size_t)j*w;
+            int taps = 0;
+            for(ky = 0; ky < ksize; ++ky){
+                int row = y*stride + ky - pad;
+                for(kx = 0; kx < ksize; ++kx){
+                    int col = x*stride + kx - pad;
+                    int t = (ky*ksize + kx)*cw;
+                    if(row < 0 || row >= height || col < 0 || col >= width){
+                        memset(b + t, 0, cw*sizeof(uint64_t));
+                        memset(m + t, 0, cw*sizeof(uint64_t));
+                    } else {
+                        memcpy(b + t, im + (size_t)(row*width + col)*cw, cw*sizeof(uint64_t));
+                        memset(m + t, 0xff, cw*sizeof(uint64_t));
+                        ++taps;
+                    }
+                }
+            }
+            for(i = ksize*ksize*cw; i < w; ++i) b[i] = m[i] = 0;
+            valid[j] = taps*channels;
+        }
+    }
+    for(i = height_col*width_col; i < round_up(height_col*width_col, XNOR_NR); ++i){
+        memset(bits + (size_t)i*w, 0, w*sizeof(uint64_t));
+        memset(mask + (size_t)i*w, 0, w*sizeof(uint64_t));
+        valid[i] = 0;
+    }
+}
+
+typedef struct {
+    const gemm_xnor_kernel *kern;
+    int M, N, w;
+    uint64_t *packed_a, *bits, *mask;
+    int *valid;
+    const gemm_epilogue *ep;
+    float *C;
+    int ldc;
+} gemm_xnor_job;
+
+static void gemm_xnor_blocks(void *ptr, int begin, int end)
+{
+    gemm_xnor_job *g = (gemm_xnor_job *)ptr;
+    int M = g->M, w = g->w, ldc = g->ldc;
+    int jb;
+    for(jb = begin; jb < end; ++jb){
+        int j = jb*XNOR_NR;
+        int cols = (g->N - j < XNOR_NR) ? g->N - j : XNOR_NR;
+        int i, t, u;
+        for(i = 0; i < M; i += XNOR_MR){
+            int rows = (M - i < XNOR_MR) ? M - i : XNOR_MR;
+            int pop[XNOR_MR*XNOR_NR];
+            g->kern->kernel(w, g->packed_a + (size_t)i*w, g->bits + (size_t)j*w, g->mask + (size_t)j*w, pop);
+            for(t = 0; t < rows; ++t){
+                for(u = 0; u < cols; ++u) g->C[(i + t)*ldc + j + u] = g->valid[j + u] - 2*pop[t*XNOR_NR + u];
+            }
+        }
+        if(g->ep) gemm_apply_epilogue(g->ep, 0, M, j, cols, g->C + j, ldc);
+    }
+}
+
+void gemm_xnor(int M, int N, int w, uint64_t *packed_a, uint64_t *bits, uint64_t *mask, int *valid,
+        const gemm_epilogue *ep, float *C, int ldc)
+{
+    gemm_xnor_job g = {get_gemm_xnor_kernel(), M, N, w, packed_a, bits, mask, valid, ep, C, ldc};
+    parallel_for((N + XNOR_NR - 1)/XNOR_NR, 4, gemm_xnor_blocks, &g);
+}
+
+void convolution_xnor(float *im, int c, int h, int w, int size, int stride, int pad,
+        uint64_t *packed, int n, const gemm_epilogue *ep, float *out)
+{
+    static thread_local void *bits = 0, *mask = 0, *valid = 0;
+    static thread_local size_t bits_size = 0, mask_size = 0, valid_size = 0;
+    int out_h = (h + 2*pad - size)/stride + 1;
+    int out_w = (w + 2*pad - size)/stride + 1;
+    int m = out_h*out_w;
+    size_t words = (size_t)round_up(m, XNOR_NR)*xnor_words(c, size);
+
+    uint64_t *b = (uint64_t *)xnor_buffer(&bits, &bits_size, words*sizeof(uint64_t));
+    uint64_t *mk = (uint64_t *)xnor_buffer(&mask, &mask_size, words*sizeof(uint64_t));
+    int *v = (int *)xnor_buffer(&valid, &valid_size, round_up(m, XNOR_NR)*sizeof(int));
+    im2col_xnor(im, c, h, w, size, stride, pad, b, mk, v);
+    gemm_xnor(n, m, xnor_words(c, size), packed, b, mk, v, ep, out, m);
+}
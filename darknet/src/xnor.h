@@ -0,0 +1,33 @@
+#ifndef XNOR_H
+#define XNOR_H
+
+#include <stdint.h>
+#include "darknet.h"
+#include "gemm.h"
+
+#define XNOR_MR 2
+#define XNOR_NR 4
+
+// Counts set bits of (a ^ b) & m over w words for MR rows of a against NR
+// columns of b/m, writing pop[r*NR + c]
+typedef void (*gemm_xnor_kernel_fn)(int w, const uint64_t *a, const uint64_t *b, const uint64_t *m, int *pop);
+
+typedef struct {
+    const char *name;
+    gemm_xnor_kernel_fn kernel;
+} gemm_xnor_kernel;
+
+const gemm_xnor_kernel *get_gemm_xnor_kernel();
+
+int xnor_words(int c, int size);
+size_t xnor_packed_size(int M, int c, int size);
+uint64_t *xnor_packed_alloc(size_t n);
+void binarize_weights_xnor(float *weights, int n, int c, int size, uint64_t *packed, float *scales);
+void im2col_xnor(float *data_im, int channels, int height, int width, int ksize, int stride, int pad,
+        uint64_t *bits, uint64_t *mask, int *valid);
+void gemm_xnor(int M, int N, int w, uint64_t *packed_a, uint64_t *bits, uint64_t *mask, int *valid,
+        const gemm_epilogue *ep, float *C, int ldc);
+void convolution_xnor(float *im, int c, int h, int w, int size, int stride, int pad,
+        uint64_t *packed, int n, const gemm_epilogue *ep, float *out);
+
+#endif
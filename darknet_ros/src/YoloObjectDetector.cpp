@@ -23,6 +23,8 @@ namespace darknet_ros
 
   char *cfg;
   char *weights;
+  char *int8Scales = 0;
+  int numThreads = 0;
   char *data;
   char **detectionNames;
 
@@ -109,6 +111,23 @@ namespace darknet_ros
     weights = new char[weightsPath.length() + 1];
     strcpy(weights, weightsPath.c_str());
 
+    // Path to INT8 activation scales, written by "darknet detector calibrate".
+    // Left empty the network runs in fp32.
+    std::string int8Model;
+    nodeHandle_.param("yolo_model/int8_scales/name", int8Model, std::string(""));
+    if (!int8Model.empty()) {
+      std::string int8Path;
+      nodeHandle_.param("weights_path", int8Path, std::string("/default"));
+      int8Path += "/" + int8Model;
+      int8Scales = new char[int8Path.length() + 1];
+      strcpy(int8Scales, int8Path.c_str());
+    }
+
+    // Threads darknet may use, shared by every layer. 0 keeps the cfg's
+    // [net] threads, else DARKNET_THREADS or one per CPU; leave some free
+    // when other nodes share the machine.
+    nodeHandle_.param("yolo_model/threads/value", numThreads, 0);
+
     // Path to config file.
     nodeHandle_.param("yolo_model/config_file/name", configModel, std::string("yolov3.cfg"));
     nodeHandle_.param("config_path", configPath, std::string("/default"));
@@ -517,8 +536,12 @@ namespace darknet_ros
     demoHier_ = hier;
     fullScreen_ = fullscreen;
     printf("YOLO V3\n");
-    net_ = load_network(cfgfile, weightfile, 0);
+    net_ = load_network_inference(cfgfile, weightfile);
+    if (numThreads <= 0) numThreads = net_->threads;
+    if (numThreads > 0) set_thread_pool_threads(numThreads);
     set_batch_network(net_, 1);
+    if (int8Scales) load_int8_scales(net_, int8Scales);
+    optimize_network(net_);
   }
 
   void YoloObjectDetector::yolo()